@@ -0,0 +1,79 @@
+#!/bin/bash
+# Count the requests the kernel sends mount.wfs for repeated stat calls on
+# one file and for reading a file sequentially twice, once with caching
+# off, once with libfuse's defaults and once with mount.wfs's defaults.
+# Extra arguments, such as "-o lowlevel", are passed to every mount.
+#
+#   ./bench_fuse_ops.sh [mount.wfs options]
+#
+# STATS and FILE_MB in the environment change the number of stat calls
+# and the size of the file read.
+set -euo pipefail
+
+STATS=${STATS:-1000}
+FILE_MB=${FILE_MB:-16}
+
+disk=$(mktemp /tmp/wfs_bench_disk.XXXXXX)
+mnt=$(mktemp -d /tmp/wfs_bench_mnt.XXXXXX)
+log=$(mktemp /tmp/wfs_bench_log.XXXXXX)
+trap 'fusermount -u "$mnt" 2> /dev/null || true; rm -rf "$disk" "$mnt" "$log"' EXIT
+
+truncate -s $((FILE_MB * 4 + 16))M "$disk"
+./mkfs.wfs "$disk"
+
+# With -d, mount.wfs stays in the foreground and logs every request
+mount_wfs() {
+    ./mount.wfs -d "$@" "$disk" "$mnt" 2> "$log" &
+    while ! mountpoint -q "$mnt"; do
+        sleep 0.1
+    done
+}
+
+unmount_wfs() {
+    fusermount -u "$mnt"
+    wait
+}
+
+# Number of requests logged so far with any of the given opcodes
+requests() {
+    local pattern
+    pattern=$(printf 'opcode: %s |' "$@")
+    grep -cE "${pattern%|}" "$log" || true
+}
+
+mount_wfs "$@"
+mkdir "$mnt/dir"
+dd if=/dev/urandom of="$mnt/dir/file" bs=1M count="$FILE_MB" status=none
+unmount_wfs
+
+printf '%-20s %22s %14s %14s\n' "caching" "requests per stat" "1st read" "2nd read"
+run() {
+    local name=$1
+    shift
+    mount_wfs "$@"
+
+    local before after
+    before=$(requests LOOKUP GETATTR)
+    for _ in $(seq "$STATS"); do
+        stat "$mnt/dir/file" > /dev/null
+    done
+    after=$(requests LOOKUP GETATTR)
+    local per_stat
+    per_stat=$(awk -v n=$((after - before)) -v stats="$STATS" 'BEGIN { printf "%.3f", n / stats }')
+
+    before=$(requests READ)
+    cat "$mnt/dir/file" > /dev/null
+    after=$(requests READ)
+    local first_read=$((after - before))
+    before=$after
+    cat "$mnt/dir/file" > /dev/null
+    after=$(requests READ)
+    local second_read=$((after - before))
+
+    unmount_wfs
+    printf '%-20s %22s %14s %14s\n' "$name" "$per_stat" "$first_read READs" "$second_read READs"
+}
+
+run "off" -o entry_timeout=0,attr_timeout=0,negative_timeout=0,no_kernel_cache,max_read=4096,max_readahead=4096 "$@"
+run "libfuse defaults" -o entry_timeout=1,attr_timeout=1,negative_timeout=0,no_kernel_cache "$@"
+run "mount.wfs defaults" "$@"
@@ -5,10 +5,24 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// The log is read and written this many bytes at a time
+#define IO_CHUNK_SIZE (4 << 20)
 
 int disk_fd = -1;
+off_t disk_size;
 struct wfs_sb sb;
 
+// Where the compacted log starts: the start of the log, or for a log that
+// wraps around the end of the disk, its current tail
+off_t new_tail;
+
+// Bytes moved, for the statistics printed at the end
+off_t bytes_read;
+off_t bytes_written;
+
 struct wfs_log_entry *read_log_entry(int fd, off_t offset) {
     struct wfs_inode inode;
     if (pread(fd, &inode, sizeof(struct wfs_inode), offset) != sizeof(struct wfs_inode)) {
@@ -28,19 +42,514 @@ struct wfs_log_entry *read_log_entry(int fd, off_t offset) {
         free(entry);
         return NULL;
     }
+    bytes_read += log_entry_size;
 
     return entry;
 }
 
-int write_log_entry(int fd, struct wfs_log_entry *entry, off_t offset) {
+// Same as in mount.wfs
+uint32_t crc32(uint32_t crc, const void *buf, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while (len--) {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+int is_inode_entry(const struct wfs_inode *inode) {
+    return inode->flags == WFS_ENTRY_FULL || inode->flags == WFS_ENTRY_DELTA ||
+           inode->flags == WFS_ENTRY_BMAP || inode->flags == WFS_ENTRY_DIR_DELTA;
+}
+
+// Whether a header read past the head could be the start of a real entry
+int plausible_entry(const struct wfs_inode *inode, off_t offset) {
+    if (offset + sizeof(struct wfs_inode) + inode->size > disk_size) {
+        return 0;
+    }
+    if (inode->flags == WFS_ENTRY_COMMIT) {
+        return inode->size == sizeof(struct wfs_commit) || inode->size == offsetof(struct wfs_commit, seq);
+    }
+    if (inode->flags == WFS_ENTRY_WRAP) {
+        return offset + sizeof(struct wfs_inode) + inode->size == disk_size;
+    }
+    if (inode->flags == WFS_ENTRY_CHECKPOINT) {
+        return inode->size >= sizeof(struct wfs_checkpoint);
+    }
+    if (inode->flags == WFS_ENTRY_DIR_DELTA) {
+        return inode->size == sizeof(struct wfs_dir_delta) && S_ISDIR(inode->mode);
+    }
+    return inode->flags < WFS_ENTRY_COMMIT && (S_ISREG(inode->mode) || S_ISDIR(inode->mode));
+}
+
+// Roll the head forward over batches committed after the superblock was
+// last written, exactly as a mount would, so they are compacted too rather
+// than lost
+void recover_log(void) {
+    off_t offset = sb.head;
+    off_t start = sb.head;
+    uint32_t crc = 0;
+    uint32_t seq = sb.seq;
+    int wrapped = 0;
+    char chunk[64 * 1024];
+    while (1) {
+        if (offset + sizeof(struct wfs_inode) > disk_size) {
+            if (sb.version < 2 || wrapped++) {
+                break;
+            }
+            offset = WFS_SB_SIZE(&sb);
+        }
+        struct wfs_inode inode;
+        if (pread(disk_fd, &inode, sizeof(inode), offset) != sizeof(inode) ||
+            !plausible_entry(&inode, offset)) {
+            break;
+        }
+        if (inode.flags == WFS_ENTRY_COMMIT) {
+            struct wfs_commit commit = {0};
+            if (pread(disk_fd, &commit, inode.size, offset + sizeof(inode)) != inode.size ||
+                commit.start != start || commit.crc != crc ||
+                (sb.version >= 2 && commit.seq != seq + 1)) {
+                break;
+            }
+            offset += sizeof(inode) + inode.size;
+            start = offset;
+            crc = 0;
+            seq = commit.seq;
+            continue;
+        }
+        if (inode.flags == WFS_ENTRY_WRAP) {
+            if (wrapped++) {
+                break;
+            }
+            crc = crc32(crc, &inode, sizeof(inode));
+            offset = WFS_SB_SIZE(&sb);
+            continue;
+        }
+
+        size_t remaining = sizeof(inode) + inode.size;
+        while (remaining > 0) {
+            size_t len = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+            if (pread(disk_fd, chunk, len, offset) != len) {
+                break;
+            }
+            crc = crc32(crc, chunk, len);
+            offset += len;
+            remaining -= len;
+        }
+        if (remaining > 0) {
+            break;
+        }
+    }
+
+    if (start != sb.head) {
+        printf("Recovered committed log entries after the head\n");
+        sb.head = start;
+        sb.seq = seq;
+    }
+}
+
+// Where the log goes on after an entry that ends at offset, as in mount.wfs
+off_t log_next(off_t offset) {
+    if (offset != sb.head && offset + sizeof(struct wfs_inode) > disk_size) {
+        return WFS_SB_SIZE(&sb);
+    }
+    return offset;
+}
+
+// How far into the log an offset is, counting from new_tail, so that
+// offsets of a wrapped log compare in log order
+off_t log_position(off_t offset) {
+    if (offset >= new_tail) {
+        return offset - new_tail;
+    }
+    return disk_size - new_tail + offset - WFS_SB_SIZE(&sb);
+}
+
+// Bytes used by a log running from tail to head
+off_t log_used(off_t tail, off_t head) {
+    if (head >= tail) {
+        return head - tail;
+    }
+    return disk_size - tail + head - WFS_SB_SIZE(&sb);
+}
+
+// The log is read through one chunk of IO_CHUNK_SIZE bytes, refilled from
+// the block holding the first byte asked for whenever a read falls outside
+// it. Reads never go past the head, or past the end of the disk for the
+// part of a wrapped log before it.
+char *chunk;
+off_t chunk_start;
+size_t chunk_len;
+
+// Make len bytes at offset readable in the chunk and return them, or NULL.
+// len may be at most IO_CHUNK_SIZE - WFS_BLOCK_SIZE.
+const char *read_chunk(off_t offset, size_t len) {
+    if (offset >= chunk_start && offset + len <= chunk_start + chunk_len) {
+        return chunk + (offset - chunk_start);
+    }
+    off_t limit = offset < sb.head ? sb.head : disk_size;
+    chunk_start = offset - offset % WFS_BLOCK_SIZE;
+    size_t want = limit - chunk_start < IO_CHUNK_SIZE ? limit - chunk_start : IO_CHUNK_SIZE;
+    chunk_len = 0;
+    while (chunk_len < want) {
+        ssize_t n = pread(disk_fd, chunk + chunk_len, want - chunk_len, chunk_start + chunk_len);
+        if (n <= 0) {
+            perror("Error reading log");
+            return NULL;
+        }
+        chunk_len += n;
+    }
+    bytes_read += chunk_len;
+    if (offset + len > chunk_start + chunk_len) {
+        fprintf(stderr, "Entry at %ld runs past the end of the log\n", (long)offset);
+        return NULL;
+    }
+    return chunk + (offset - chunk_start);
+}
+
+// Inode number -> offset of its latest entry, 0 if it has none
+uint32_t *latest;
+unsigned int num_latest;
+
+int set_latest(unsigned int inode_number, off_t offset) {
+    if (inode_number >= num_latest) {
+        unsigned int new_num = num_latest ? num_latest : 1024;
+        while (new_num <= inode_number) {
+            new_num *= 2;
+        }
+        uint32_t *new_latest = realloc(latest, sizeof(uint32_t) * new_num);
+        if (!new_latest) {
+            perror("Error allocating inode map");
+            return -1;
+        }
+        memset(new_latest + num_latest, 0, sizeof(uint32_t) * (new_num - num_latest));
+        latest = new_latest;
+        num_latest = new_num;
+    }
+    latest[inode_number] = offset;
+    return 0;
+}
+
+// First pass: read only the headers, in log order, to find the latest
+// entry of every inode. Returns the number of entries, or -1.
+long scan_log(void) {
+    long num_entries = 0;
+    off_t offset = sb.tail;
+    while (offset != sb.head) {
+        const struct wfs_inode *inode = (const struct wfs_inode *)read_chunk(offset, sizeof(struct wfs_inode));
+        if (!inode) {
+            return -1;
+        }
+        off_t limit = offset < sb.head ? sb.head : disk_size;
+        if (offset + sizeof(struct wfs_inode) + inode->size > limit) {
+            fprintf(stderr, "Entry at %ld runs past the end of the log\n", (long)offset);
+            return -1;
+        }
+        if (is_inode_entry(inode) && set_latest(inode->inode_number, inode->deleted ? 0 : offset) != 0) {
+            return -1;
+        }
+        num_entries++;
+        offset = log_next(offset + sizeof(struct wfs_inode) + inode->size);
+    }
+    return num_entries;
+}
+
+// Every entry that is kept, and where it is moved to. Once sorted in log
+// order, pointers stored in entries can be rewritten to the new offsets.
+struct relocation {
+    off_t old_offset;
+    off_t new_offset;
+};
+
+struct relocation *relocations;
+size_t num_relocations;
+size_t max_relocations;
+
+int add_relocation(off_t old_offset, off_t new_offset) {
+    if (num_relocations == max_relocations) {
+        size_t new_max = max_relocations ? max_relocations * 2 : 256;
+        struct relocation *new_relocations = realloc(relocations, sizeof(struct relocation) * new_max);
+        if (!new_relocations) {
+            perror("Error allocating relocation table");
+            return -1;
+        }
+        relocations = new_relocations;
+        max_relocations = new_max;
+    }
+    relocations[num_relocations].old_offset = old_offset;
+    relocations[num_relocations].new_offset = new_offset;
+    num_relocations++;
+    return 0;
+}
+
+int compare_relocations(const void *a, const void *b) {
+    off_t x = log_position(((const struct relocation *)a)->old_offset);
+    off_t y = log_position(((const struct relocation *)b)->old_offset);
+    return x < y ? -1 : x > y;
+}
+
+struct relocation *find_relocation(off_t old_offset) {
+    off_t position = log_position(old_offset);
+    size_t low = 0, high = num_relocations;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (log_position(relocations[mid].old_offset) < position) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == num_relocations || relocations[low].old_offset != old_offset) {
+        return NULL;
+    }
+    return &relocations[low];
+}
+
+// Offset of the full entry the root's latest entry builds on
+off_t root_base;
+
+// Keep the latest entry of every inode and whatever it builds on: the
+// deltas and full entry before it, or a block map's indirect blocks and
+// the blocks they point at. Superseded versions, deleted inodes, commit
+// records and checkpoints are all dropped.
+int find_live_entries(void) {
+    for (unsigned int i = 0; i < num_latest; i++) {
+        off_t offset = latest[i];
+        if (offset == 0) {
+            continue;
+        }
+        struct wfs_inode inode;
+        if (pread(disk_fd, &inode, sizeof(inode), offset) != sizeof(inode)) {
+            perror("Error reading inode");
+            return -1;
+        }
+        if (inode.flags != WFS_ENTRY_BMAP) {
+            // Both kinds of delta start with the offset of the entry before
+            while (1) {
+                if (add_relocation(offset, 0) != 0) {
+                    return -1;
+                }
+                if (inode.flags != WFS_ENTRY_DELTA && inode.flags != WFS_ENTRY_DIR_DELTA) {
+                    break;
+                }
+                uint32_t prev;
+                if (pread(disk_fd, &prev, sizeof(prev), offset + sizeof(inode)) != sizeof(prev) ||
+                    pread(disk_fd, &inode, sizeof(inode), prev) != sizeof(inode)) {
+                    perror("Error reading delta");
+                    return -1;
+                }
+                offset = prev;
+            }
+            if (i == 0) {
+                root_base = offset;
+            }
+            continue;
+        }
+
+        struct wfs_log_entry *bmap_entry = read_log_entry(disk_fd, offset);
+        if (!bmap_entry || add_relocation(offset, 0) != 0) {
+            free(bmap_entry);
+            return -1;
+        }
+        struct wfs_bmap *bmap = (struct wfs_bmap *)bmap_entry->data;
+        for (uint32_t j = 0; j < bmap->num_indirect; j++) {
+            if (bmap->indirect[j] == 0) {
+                continue;
+            }
+            struct wfs_log_entry *indirect_entry = read_log_entry(disk_fd, bmap->indirect[j]);
+            if (!indirect_entry || add_relocation(bmap->indirect[j], 0) != 0) {
+                free(indirect_entry);
+                free(bmap_entry);
+                return -1;
+            }
+            uint32_t *pointers = (uint32_t *)((struct wfs_block *)indirect_entry->data)->data;
+            for (size_t k = 0; k < WFS_PTRS_PER_BLOCK; k++) {
+                if (pointers[k] != 0 && add_relocation(pointers[k], 0) != 0) {
+                    free(indirect_entry);
+                    free(bmap_entry);
+                    return -1;
+                }
+            }
+            free(indirect_entry);
+        }
+        free(bmap_entry);
+    }
+    qsort(relocations, num_relocations, sizeof(struct relocation), compare_relocations);
+    return 0;
+}
+
+int relocate_pointer(uint32_t *pointer, off_t entry_offset) {
+    if (*pointer == 0) {
+        return 0; // Hole in a block-mapped file
+    }
+    struct relocation *relocation = find_relocation(*pointer);
+    if (!relocation) {
+        fprintf(stderr, "Entry at %ld points at missing entry %u\n", (long)entry_offset, *pointer);
+        return -1;
+    }
+    *pointer = relocation->new_offset;
+    return 0;
+}
+
+// Rewrite the offsets stored in an entry to where their targets were moved
+int relocate_pointers(struct wfs_log_entry *entry, off_t entry_offset) {
+    if (entry->inode.flags == WFS_ENTRY_DELTA) {
+        struct wfs_delta *delta = (struct wfs_delta *)entry->data;
+        return relocate_pointer(&delta->prev, entry_offset);
+    }
+    if (entry->inode.flags == WFS_ENTRY_DIR_DELTA) {
+        struct wfs_dir_delta *delta = (struct wfs_dir_delta *)entry->data;
+        return relocate_pointer(&delta->prev, entry_offset);
+    }
+    if (entry->inode.flags == WFS_ENTRY_BMAP) {
+        struct wfs_bmap *bmap = (struct wfs_bmap *)entry->data;
+        for (uint32_t i = 0; i < bmap->num_indirect; i++) {
+            if (relocate_pointer(&bmap->indirect[i], entry_offset) != 0) {
+                return -1;
+            }
+        }
+    }
+    if (entry->inode.flags == WFS_ENTRY_INDIRECT) {
+        uint32_t *pointers = (uint32_t *)((struct wfs_block *)entry->data)->data;
+        for (size_t i = 0; i < WFS_PTRS_PER_BLOCK; i++) {
+            if (relocate_pointer(&pointers[i], entry_offset) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Kept entries are gathered in out_buf and written out at out_start
+char *out_buf;
+size_t out_len;
+size_t out_cap;
+off_t out_start;
+
+int flush_output(void) {
+    if (out_len > 0 && pwrite(disk_fd, out_buf, out_len, out_start) != out_len) {
+        perror("Error writing log entries");
+        return -1;
+    }
+    bytes_written += out_len;
+    out_start += out_len;
+    out_len = 0;
+    return 0;
+}
+
+// Append a kept entry to the output and move its pointers. The output is
+// only written out once it ends before next_input, the next entry still to
+// be read, or -1 if there is none, and grows in memory until then.
+int emit_entry(const struct wfs_log_entry *entry, struct relocation *relocation, off_t next_input) {
     size_t entry_size = sizeof(struct wfs_inode) + entry->inode.size;
-    if (pwrite(fd, entry, entry_size, offset) != entry_size) {
-        perror("Error writing log entry");
+    if (out_start + out_len + entry_size > disk_size) {
+        // Wrap like the mount does. The output never catches up with the
+        // input, so this only happens once the input has wrapped too.
+        if (flush_output() != 0) {
+            return -1;
+        }
+        if (out_start + sizeof(struct wfs_inode) <= disk_size) {
+            struct wfs_inode marker = {0};
+            marker.flags = WFS_ENTRY_WRAP;
+            marker.size = disk_size - out_start - sizeof(marker);
+            if (pwrite(disk_fd, &marker, sizeof(marker), out_start) != sizeof(marker)) {
+                perror("Error writing log entries");
+                return -1;
+            }
+        }
+        out_start = WFS_SB_SIZE(&sb);
+    }
+    if (out_len + entry_size > out_cap) {
+        if (next_input < 0 || log_position(out_start + out_len) <= log_position(next_input)) {
+            if (flush_output() != 0) {
+                return -1;
+            }
+        }
+        if (out_len + entry_size > out_cap) {
+            size_t new_cap = out_cap * 2 > out_len + entry_size ? out_cap * 2 : out_len + entry_size;
+            char *new_buf = realloc(out_buf, new_cap);
+            if (!new_buf) {
+                perror("Error allocating output buffer");
+                return -1;
+            }
+            out_buf = new_buf;
+            out_cap = new_cap;
+        }
+    }
+
+    struct wfs_log_entry *copy = (struct wfs_log_entry *)(out_buf + out_len);
+    memcpy(copy, entry, entry_size);
+    // Entries only point back at older entries, which have already moved
+    if (relocate_pointers(copy, relocation->old_offset) != 0) {
         return -1;
     }
+    relocation->new_offset = out_start + out_len;
+    out_len += entry_size;
     return 0;
 }
 
+// Second pass: copy the kept entries in log order. Small entries are read
+// through the chunk, larger ones on their own.
+int copy_live_entries(void) {
+    out_cap = IO_CHUNK_SIZE;
+    out_buf = malloc(out_cap);
+    if (!out_buf) {
+        perror("Error allocating output buffer");
+        return -1;
+    }
+    out_start = new_tail;
+
+    // On version 0 images the superblock ends where version would be, and
+    // reads as 0 only because the root's entry comes first
+    struct relocation *root = NULL;
+    if (sb.version == 0) {
+        root = find_relocation(root_base);
+        struct wfs_log_entry *entry = read_log_entry(disk_fd, root_base);
+        if (!root || !entry || emit_entry(entry, root, relocations[0].old_offset) != 0) {
+            free(entry);
+            return -1;
+        }
+        free(entry);
+    }
+
+    for (size_t i = 0; i < num_relocations; i++) {
+        if (&relocations[i] == root) {
+            continue;
+        }
+        off_t offset = relocations[i].old_offset;
+        off_t next_input = i + 1 < num_relocations ? relocations[i + 1].old_offset : -1;
+        const struct wfs_inode *inode = (const struct wfs_inode *)read_chunk(offset, sizeof(struct wfs_inode));
+        if (!inode) {
+            return -1;
+        }
+        size_t entry_size = sizeof(struct wfs_inode) + inode->size;
+        if (entry_size <= IO_CHUNK_SIZE - WFS_BLOCK_SIZE) {
+            const struct wfs_log_entry *entry = (const struct wfs_log_entry *)read_chunk(offset, entry_size);
+            if (!entry || emit_entry(entry, &relocations[i], next_input) != 0) {
+                return -1;
+            }
+        } else {
+            struct wfs_log_entry *entry = read_log_entry(disk_fd, offset);
+            if (!entry || emit_entry(entry, &relocations[i], next_input) != 0) {
+                free(entry);
+                return -1;
+            }
+            free(entry);
+        }
+    }
+    return flush_output();
+}
+
 int main(int argc, char *argv[]) {
     if (argc != 2) {
         fprintf(stderr, "Usage: %s <disk image>\n", argv[0]);
@@ -65,38 +574,76 @@ int main(int argc, char *argv[]) {
         close(disk_fd);
         return -1;
     }
+    if (sb.version > WFS_VERSION) {
+        fprintf(stderr, "Unsupported filesystem version %u\n", sb.version);
+        close(disk_fd);
+        return -1;
+    }
+    if (sb.version < 2) {
+        // What was read past the end of an older superblock is the root entry
+        sb.tail = WFS_SB_SIZE(&sb);
+        sb.seq = 0;
+    }
+    struct stat disk_stat;
+    if (fstat(disk_fd, &disk_stat) != 0) {
+        perror("Error reading disk size");
+        close(disk_fd);
+        return -1;
+    }
+    disk_size = disk_stat.st_size;
 
-    off_t current_offset = sizeof(struct wfs_sb);
-    off_t new_offset = current_offset;
-
-    while (current_offset < sb.head) {
-        struct wfs_log_entry *entry = read_log_entry(disk_fd, current_offset);
-        if (!entry) {
-            close(disk_fd);
-            return -1;
-        }
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    recover_log();
+    off_t old_used = log_used(sb.tail, sb.head);
+    // A log that does not wrap is moved to the start of the disk. One that
+    // does stays where it is, since its start is still in use.
+    new_tail = sb.head >= sb.tail ? WFS_SB_SIZE(&sb) : sb.tail;
 
-        if (!entry->inode.deleted) {
-            if (write_log_entry(disk_fd, entry, new_offset) != 0) {
-                free(entry);
-                close(disk_fd);
-                return -1;
-            }
-            new_offset += sizeof(struct wfs_inode) + entry->inode.size;
-        }
+    chunk = malloc(IO_CHUNK_SIZE);
+    if (!chunk) {
+        perror("Error allocating read buffer");
+        close(disk_fd);
+        return -1;
+    }
+    long num_entries = scan_log();
+    if (num_entries < 0 || find_live_entries() != 0 || copy_live_entries() != 0) {
+        close(disk_fd);
+        return -1;
+    }
 
-        current_offset += sizeof(struct wfs_inode) + entry->inode.size;
-        free(entry);
+    // Clear the header at the new head, so the mount does not mistake the
+    // old entries left behind it for a batch to roll forward over
+    off_t new_head = out_start;
+    struct wfs_inode end_marker = {0};
+    if (new_head + sizeof(end_marker) <= disk_size &&
+        (new_head >= new_tail || new_head + sizeof(end_marker) <= new_tail) &&
+        pwrite(disk_fd, &end_marker, sizeof(end_marker), new_head) != sizeof(end_marker)) {
+        perror("Error clearing log tail");
+        close(disk_fd);
+        return -1;
     }
 
-    sb.head = new_offset;
-    if (pwrite(disk_fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+    sb.head = new_head;
+    sb.tail = new_tail;
+    sb.checkpoint = 0;
+    if (pwrite(disk_fd, &sb, WFS_SB_SIZE(&sb), 0) != WFS_SB_SIZE(&sb)) {
         perror("Error updating superblock");
         close(disk_fd);
         return -1;
     }
-
     close(disk_fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    off_t new_used = log_used(sb.tail, sb.head);
+    double mib = (bytes_read + bytes_written) / (double)(1 << 20);
+    printf("Log compacted from %ld to %ld bytes (%.1f%% freed), %zu of %ld entries kept\n",
+           (long)old_used, (long)new_used, old_used ? 100.0 * (old_used - new_used) / old_used : 0.0,
+           num_relocations, num_entries);
+    printf("Read %.1f MiB and wrote %.1f MiB in %.3f s (%.1f MiB/s)\n",
+           bytes_read / (double)(1 << 20), bytes_written / (double)(1 << 20), seconds,
+           seconds > 0 ? mib / seconds : 0.0);
     printf("Filesystem compaction completed successfully.\n");
 
     return 0;
@@ -33,7 +33,7 @@ int main (int argc, char *argv[]) {
     };
     
     //initialze and update superblock
-    struct wfs_sb sb = {WFS_MAGIC, sizeof(struct wfs_sb) + sizeof(root_entry)};
+    struct wfs_sb sb = {WFS_MAGIC, sizeof(struct wfs_sb) + sizeof(root_entry), WFS_VERSION, 0, sizeof(struct wfs_sb), 0};
     lseek(fd, 0, SEEK_SET);
     if (write(fd, &sb, sizeof(sb)) != sizeof(sb)) {
         perror("Error updating superblock");
@@ -46,6 +46,14 @@ int main (int argc, char *argv[]) {
         close(fd);
         return 1;
     }
+    // Clear the header after it, in case the disk held an older file system
+    // whose entries the mount would otherwise try to roll forward over
+    struct wfs_inode end_marker = {0};
+    if (write(fd, &end_marker, sizeof(end_marker)) != sizeof(end_marker)) {
+        printf("error clearing log tail\n");
+        close(fd);
+        return 1;
+    }
 
 
 
@@ -1,5 +1,6 @@
 #define FUSE_USE_VERSION 30
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -8,65 +9,855 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+
+// Once a file has this many deltas on top of its last full entry, the
+// next write appends the whole file again so reads stay cheap
+#define MAX_DELTA_DEPTH 16
+
+// Files that grow past this size are moved out of line into block entries
+#define MAX_INLINE_SIZE (16 * WFS_BLOCK_SIZE)
+
+// A checkpoint is appended once this much log follows the last one, and
+// at unmount, so a mount never replays more than about this much
+#define CHECKPOINT_INTERVAL (16 << 20)
+
+// When appended entries are committed, chosen with -o durability=
+#define DURABILITY_NONE 0       // commit every commit_interval ms, never sync
+#define DURABILITY_PERIODIC 1   // commit and sync every commit_interval ms
+#define DURABILITY_SYNC 2       // commit and sync before each operation returns
 
 int disk_fd = -1;
+off_t disk_size;
+
+// The disk image mapped into memory with -o mmap, or NULL. Writes through
+// it are tracked as [map_dirty_start, map_dirty_end) for the next msync.
+char *disk_map;
+off_t map_dirty_start;
+off_t map_dirty_end;
+
+// Every write to the image bumps disk_written_gen, under wfs_lock, and
+// disk_synced_gen is the last generation known to be durable, under
+// sync_lock. A sync with nothing new to make durable costs nothing, and
+// syncs that overlap only wait for the disk once.
+uint64_t disk_written_gen;
+uint64_t disk_synced_gen;
+pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Options given with -o on the command line, see wfs_opts
+struct wfs_config {
+    unsigned long dcache_size;  // memory cap for the dentry cache, in bytes
+    unsigned long dir_index_size; // memory cap for directory indexes, in bytes
+    unsigned long writeback_size; // bytes buffered per open file before they are appended
+    int durability;             // one of DURABILITY_*
+    unsigned long commit_interval; // ms between background commits
+    unsigned long clean_rate;   // bytes per second the cleaner frees while idle, 0 disables it
+    int lowlevel;               // serve the inode-based low-level FUSE API instead of paths
+    double entry_timeout;       // seconds the kernel may cache what a name resolves to
+    double attr_timeout;        // seconds the kernel may cache attributes
+    double negative_timeout;    // seconds the kernel may cache that a name does not exist
+    int kernel_cache;           // keep file pages in the kernel's cache across opens
+    int use_mmap;               // access the disk image through a shared mapping
+    int use_uring;              // submit writes and syncs through io_uring
+    unsigned long block_cache_size; // memory for cached pages of the disk image, in bytes
+};
+
+struct wfs_config config = {
+    .dcache_size = 4 << 20,
+    .dir_index_size = 64 << 20,
+    .writeback_size = 1 << 20,
+    .durability = DURABILITY_PERIODIC,
+    .commit_interval = 5000,
+    .clean_rate = 4 << 20,
+    .entry_timeout = 60,
+    .attr_timeout = 60,
+    .negative_timeout = 60,
+    .kernel_cache = 1,
+    .block_cache_size = 16 << 20,
+};
+
+// FUSE options mount.wfs adds in front of the command line, so any given
+// there win. Requests go up to 128 KiB each way, the most libfuse 2
+// allows, and readahead as far as the kernel will go.
+#define DEFAULT_FUSE_OPTS "-omax_write=131072,max_read=131072,max_readahead=1048576"
+
+static struct fuse_opt wfs_opts[] = {
+    {"dcache_size=%lu", offsetof(struct wfs_config, dcache_size), 0},
+    {"dir_index_size=%lu", offsetof(struct wfs_config, dir_index_size), 0},
+    {"writeback_size=%lu", offsetof(struct wfs_config, writeback_size), 0},
+    {"durability=none", offsetof(struct wfs_config, durability), DURABILITY_NONE},
+    {"durability=periodic", offsetof(struct wfs_config, durability), DURABILITY_PERIODIC},
+    {"durability=sync", offsetof(struct wfs_config, durability), DURABILITY_SYNC},
+    {"commit_interval=%lu", offsetof(struct wfs_config, commit_interval), 0},
+    {"clean_rate=%lu", offsetof(struct wfs_config, clean_rate), 0},
+    {"lowlevel", offsetof(struct wfs_config, lowlevel), 1},
+    {"entry_timeout=%lf", offsetof(struct wfs_config, entry_timeout), 0},
+    {"attr_timeout=%lf", offsetof(struct wfs_config, attr_timeout), 0},
+    {"negative_timeout=%lf", offsetof(struct wfs_config, negative_timeout), 0},
+    {"kernel_cache", offsetof(struct wfs_config, kernel_cache), 1},
+    {"no_kernel_cache", offsetof(struct wfs_config, kernel_cache), 0},
+    {"mmap", offsetof(struct wfs_config, use_mmap), 1},
+    {"io_uring", offsetof(struct wfs_config, use_uring), 1},
+    {"block_cache_size=%lu", offsetof(struct wfs_config, block_cache_size), 0},
+    FUSE_OPT_END
+};
+
+// FUSE calls in from several threads, and the commit and cleaner threads
+// run alongside them, so every operation holds this lock from start to
+// finish. Operations that only read hold it shared, and anything that
+// appends to the log or changes in-memory state holds it exclusively.
+// Writers are preferred so a stream of reads cannot starve them.
+pthread_rwlock_t wfs_lock;
+
+// Under a shared wfs_lock, lookups still fill the dentry cache and build
+// directory indexes, so those also take this lock
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
-unsigned int max_inode;
-unsigned int * used_inodes;
 struct wfs_sb sb;
 
-struct wfs_log_entry *find_last_log_entry(int fd, unsigned int inode_number) {
-    off_t current_offset = sizeof(struct wfs_sb); // Assuming the log starts after the superblock
-    struct wfs_log_entry *latest_entry = NULL;
-    size_t entry_size;
-
-    while (current_offset < sb.head) {
-        // Read the inode part of the log entry
-        struct wfs_inode temp_inode;
-        ssize_t read_size = pread(fd, &temp_inode, sizeof(struct wfs_inode), current_offset);
-        if (read_size != sizeof(struct wfs_inode)) {
-            perror("Error reading inode, helper func");
-            // End of log or error
+// In-memory inode map: inode number -> offset of the latest live log entry
+// for that inode, or 0 if the inode is free or deleted. Built by the startup
+// scan in main() and kept current by append_log_entry().
+off_t *inode_map;
+unsigned int inode_map_len;
+
+// Low-level mounts only: how many lookups of each inode the kernel holds
+// and has not forgotten yet, indexed like inode_map and grown with it.
+// Lookups bump these under a shared wfs_lock, so they are atomic.
+uint64_t *lookup_counts;
+
+off_t inode_map_get(unsigned int inode_number) {
+    if (inode_number >= inode_map_len) {
+        return 0;
+    }
+    return inode_map[inode_number];
+}
+
+// Make room in the inode map for inode_number
+int inode_map_grow(unsigned int inode_number) {
+    if (inode_number >= inode_map_len) {
+        unsigned int new_len = inode_map_len ? inode_map_len : 64;
+        while (new_len <= inode_number) {
+            new_len *= 2;
+        }
+        off_t *new_map = realloc(inode_map, sizeof(off_t) * new_len);
+        if (new_map == NULL) {
+            perror("Error growing inode map");
+            return -ENOMEM;
+        }
+        memset(new_map + inode_map_len, 0, sizeof(off_t) * (new_len - inode_map_len));
+        inode_map = new_map;
+        uint64_t *new_counts = realloc(lookup_counts, sizeof(uint64_t) * new_len);
+        if (new_counts == NULL) {
+            perror("Error growing inode map");
+            return -ENOMEM;
+        }
+        memset(new_counts + inode_map_len, 0, sizeof(uint64_t) * (new_len - inode_map_len));
+        lookup_counts = new_counts;
+        inode_map_len = new_len;
+    }
+    return 0;
+}
+
+int inode_map_set(unsigned int inode_number, off_t offset) {
+    int ret = inode_map_grow(inode_number);
+    if (ret != 0) {
+        return ret;
+    }
+    inode_map[inode_number] = offset;
+    return 0;
+}
+
+// Inode number allocator. inode_bitmap has a bit set for every number in
+// use, and inode_full has a bit set for every bitmap word with no free bit
+// left, so a free number is found with two ctz steps. Words of inode_full
+// below alloc_hint are known to be full.
+uint64_t *inode_bitmap;
+uint64_t *inode_full;
+size_t inode_full_words;    // inode_bitmap has 64 times as many words
+size_t alloc_hint;
+
+int inode_bitmap_grow(size_t min_full_words) {
+    size_t new_words = inode_full_words ? inode_full_words : 1;
+    while (new_words < min_full_words) {
+        new_words *= 2;
+    }
+    uint64_t *new_bitmap = realloc(inode_bitmap, sizeof(uint64_t) * 64 * new_words);
+    if (new_bitmap == NULL) {
+        perror("Error growing inode bitmap");
+        return -ENOMEM;
+    }
+    inode_bitmap = new_bitmap;
+    uint64_t *new_full = realloc(inode_full, sizeof(uint64_t) * new_words);
+    if (new_full == NULL) {
+        perror("Error growing inode bitmap");
+        return -ENOMEM;
+    }
+    inode_full = new_full;
+    memset(inode_bitmap + 64 * inode_full_words, 0, sizeof(uint64_t) * 64 * (new_words - inode_full_words));
+    memset(inode_full + inode_full_words, 0, sizeof(uint64_t) * (new_words - inode_full_words));
+    inode_full_words = new_words;
+    return 0;
+}
+
+int inode_mark_used(unsigned int inode_number) {
+    size_t word = inode_number / 64;
+    if (word / 64 >= inode_full_words && inode_bitmap_grow(word / 64 + 1) != 0) {
+        return -ENOMEM;
+    }
+    inode_bitmap[word] |= (uint64_t)1 << (inode_number % 64);
+    if (inode_bitmap[word] == ~(uint64_t)0) {
+        inode_full[word / 64] |= (uint64_t)1 << (word % 64);
+    }
+    return 0;
+}
+
+// Take the lowest free inode number. Returns -1 if none can be had.
+unsigned int inode_alloc(void) {
+    while (alloc_hint < inode_full_words && inode_full[alloc_hint] == ~(uint64_t)0) {
+        alloc_hint++;
+    }
+    if (alloc_hint == inode_full_words && inode_bitmap_grow(inode_full_words + 1) != 0) {
+        return -1;
+    }
+    size_t word = alloc_hint * 64 + __builtin_ctzll(~inode_full[alloc_hint]);
+    unsigned int inode_number = word * 64 + __builtin_ctzll(~inode_bitmap[word]);
+    if (inode_number == (unsigned int)-1) {
+        return -1; // Reserved for "not found"
+    }
+    inode_mark_used(inode_number);
+    return inode_number;
+}
+
+void inode_release(unsigned int inode_number) {
+    size_t word = inode_number / 64;
+    if (word / 64 >= inode_full_words) {
+        return;
+    }
+    inode_bitmap[word] &= ~((uint64_t)1 << (inode_number % 64));
+    inode_full[word / 64] &= ~((uint64_t)1 << (word % 64));
+    if (word / 64 < alloc_hint) {
+        alloc_hint = word / 64;
+    }
+}
+
+// Per-open state kept in fuse_file_info->fh. Writes through a handle are
+// collected in one contiguous dirty range and appended to the log as a
+// single write on flush, release, fsync or once config.writeback_size
+// bytes are buffered. At most one handle holds dirty data for an inode.
+// The handle also keeps the header of the file's latest entry, which is
+// good for as long as the inode map still points at entry_offset.
+struct wfs_handle {
+    unsigned int inode_number;
+    struct wfs_inode inode;     // as load_inode() returns it, guarded by cache_lock
+    unsigned int depth;
+    off_t entry_offset;         // where inode was read from, 0 if nothing is cached
+    char *dirty;                // buffered bytes of [dirty_offset, dirty_offset + dirty_len)
+    off_t dirty_offset;
+    size_t dirty_len;
+    size_t dirty_cap;
+    off_t ra_next;              // where a sequential read would go on, guarded by cache_lock
+    off_t ra_end;               // how far ahead of it reads have been prefetched
+    size_t ra_window;           // bytes prefetched at a time, 0 while reads are random
+    struct wfs_handle *next;    // next in open_handles
+};
+
+struct wfs_handle *open_handles;
+// Handles with nothing buffered are opened and closed with wfs_lock shared,
+// so the list also changes under this lock, which walks with wfs_lock
+// shared take as well
+pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct wfs_handle *find_handle(unsigned int inode_number) {
+    for (struct wfs_handle *handle = open_handles; handle != NULL; handle = handle->next) {
+        if (handle->inode_number == inode_number) {
+            return handle;
+        }
+    }
+    return NULL;
+}
+
+struct wfs_handle *find_dirty_handle(unsigned int inode_number) {
+    struct wfs_handle *handle;
+    pthread_mutex_lock(&handles_lock);
+    for (handle = open_handles; handle != NULL; handle = handle->next) {
+        if (handle->inode_number == inode_number && handle->dirty_len != 0) {
             break;
         }
+    }
+    pthread_mutex_unlock(&handles_lock);
+    return handle;
+}
+
+void unlink_handle(struct wfs_handle *handle) {
+    pthread_mutex_lock(&handles_lock);
+    struct wfs_handle **link = &open_handles;
+    while (*link != handle) {
+        link = &(*link)->next;
+    }
+    *link = handle->next;
+    pthread_mutex_unlock(&handles_lock);
+}
+
+// An unlinked inode keeps its number while an open file or a lookup the
+// kernel has not forgotten still refers to it
+int inode_referenced(unsigned int inode_number) {
+    if (find_handle(inode_number) != NULL) {
+        return 1;
+    }
+    return inode_number < inode_map_len && __atomic_load_n(&lookup_counts[inode_number], __ATOMIC_RELAXED) != 0;
+}
 
-        // Calculate the size of the log entry
-        entry_size = sizeof(struct wfs_inode) + temp_inode.size;
+// Size of a file including data still buffered in an open handle
+size_t buffered_size(unsigned int inode_number, size_t size) {
+    struct wfs_handle *handle = find_dirty_handle(inode_number);
+    if (handle != NULL && handle->dirty_offset + handle->dirty_len > size) {
+        return handle->dirty_offset + handle->dirty_len;
+    }
+    return size;
+}
+
+// Writes to the disk image are queued in memory and go out together when
+// the log is committed or synced, or once the queue fills up. Contiguous
+// writes, like consecutive appends, are merged into one. Until then reads
+// see them through disk_pread().
+#define MAX_QUEUED_WRITES 8
+#define WRITE_QUEUE_SIZE (1 << 20)
+
+struct queued_write {
+    off_t offset;   // on the disk
+    size_t pos;     // in write_queue
+    size_t len;
+};
+
+char *write_queue;
+size_t write_queue_len;
+size_t write_queue_cap;
+struct queued_write queued_writes[MAX_QUEUED_WRITES];
+unsigned int num_queued_writes;
+
+// With -o io_uring, queued writes are submitted through an io_uring with
+// the sync after them linked in, all in one system call. Set up by
+// uring_init(); without it, fd is -1 and they are written one by one with
+// pwrite().
+struct wfs_uring {
+    int fd;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct wfs_uring uring = { .fd = -1 };
+
+// Room for every queued write and the sync
+#define URING_ENTRIES (MAX_QUEUED_WRITES + 1)
+
+void uring_init(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0) {
+        perror("io_uring not available, writing with pwrite");
+        return;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd); // Unmapping is left to exit
+        return;
+    }
+    uring.sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    uring.sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned int *)(sq + params.sq_off.array);
+    uring.sqes = sqes;
+    uring.cq_head = (unsigned int *)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    uring.cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    uring.fd = fd;
+}
+
+// Write the queued writes in order, followed by an fdatasync if sync is
+// set, as a chain of linked requests, and wait for all of them
+int uring_submit(struct iovec *iov, unsigned int count, int sync) {
+    unsigned int tail = *uring.sq_tail;
+    unsigned int num_requests = count + (sync ? 1 : 0);
+    for (unsigned int i = 0; i < num_requests; i++) {
+        unsigned int index = (tail + i) & uring.sq_mask;
+        struct io_uring_sqe *sqe = &uring.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = disk_fd;
+        if (i < count) {
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->addr = (uintptr_t)&iov[i];
+            sqe->len = 1;
+            sqe->off = queued_writes[i].offset;
+        } else {
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+        if (i + 1 < num_requests) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        sqe->user_data = i;
+        uring.sq_array[index] = index;
+    }
+    __atomic_store_n(uring.sq_tail, tail + num_requests, __ATOMIC_RELEASE);
+
+    unsigned int to_submit = num_requests;
+    unsigned int completed = 0;
+    int ret = 0;
+    while (completed < num_requests) {
+        int submitted = syscall(__NR_io_uring_enter, uring.fd, to_submit, num_requests - completed,
+                                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error submitting writes");
+            return -EIO;
+        }
+        to_submit -= submitted;
+        unsigned int head = *uring.cq_head;
+        while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+            if (cqe->res < 0 || (cqe->user_data < count && cqe->res != iov[cqe->user_data].iov_len)) {
+                ret = -EIO; // A failed write cancels the rest of the chain
+            }
+            head++;
+            completed++;
+        }
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return ret;
+}
 
-        // Check if this log entry is for the inode we're looking for
-        if (temp_inode.inode_number == inode_number && !temp_inode.deleted) {
-            // Free the previous latest entry
-            if (latest_entry) {
-                free(latest_entry);
+// Write out everything queued, and make it durable if sync is set
+int submit_writes(int sync) {
+    struct iovec iov[MAX_QUEUED_WRITES];
+    for (unsigned int i = 0; i < num_queued_writes; i++) {
+        iov[i].iov_base = write_queue + queued_writes[i].pos;
+        iov[i].iov_len = queued_writes[i].len;
+    }
+    int ret = 0;
+    if (uring.fd != -1 && (num_queued_writes != 0 || sync)) {
+        ret = uring_submit(iov, num_queued_writes, sync);
+    } else {
+        for (unsigned int i = 0; i < num_queued_writes && ret == 0; i++) {
+            if (pwrite(disk_fd, iov[i].iov_base, iov[i].iov_len, queued_writes[i].offset) != iov[i].iov_len) {
+                ret = -EIO;
             }
+        }
+        if (ret == 0 && sync && fdatasync(disk_fd) != 0) {
+            ret = -EIO;
+        }
+    }
+    num_queued_writes = 0;
+    write_queue_len = 0;
+    return ret;
+}
 
-            // Allocate memory and read the full log entry
-            latest_entry = (struct wfs_log_entry *)malloc(entry_size);
-            if (!latest_entry) {
-                perror("Error allocating memory for log entry");
-                break;
+// Whether part of [offset, offset + size) is queued and not yet written
+int write_queued(off_t offset, size_t size) {
+    for (unsigned int i = 0; i < num_queued_writes; i++) {
+        if (queued_writes[i].offset < offset + size && queued_writes[i].offset + queued_writes[i].len > offset) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Read the image as it stands, queued writes included
+ssize_t read_image(void *buf, size_t size, off_t offset) {
+    ssize_t ret = pread(disk_fd, buf, size, offset);
+    // Queued writes are newer than what is on the disk, and later ones
+    // newer than earlier ones
+    for (unsigned int i = 0; ret > 0 && i < num_queued_writes; i++) {
+        struct queued_write *queued = &queued_writes[i];
+        off_t start = queued->offset > offset ? queued->offset : offset;
+        off_t end = queued->offset + queued->len < offset + ret ? queued->offset + queued->len : offset + ret;
+        if (start < end) {
+            memcpy((char *)buf + (start - offset), write_queue + queued->pos + (start - queued->offset), end - start);
+        }
+    }
+    return ret;
+}
+
+// Block cache: pages of the disk image kept in memory when there is no
+// mapping, so inodes, directories and small files that are read again do
+// not cost a pread. Writes update cached pages as they are made, so a page
+// is never stale. Slots are reused in CLOCK order: a page read since the
+// hand last passed gets another round. A page being filled is pinned, and
+// the hand skips it while its reader works without bcache_lock.
+#define BCACHE_PAGE_SIZE 4096
+
+// Larger reads, such as the cleaner's, go around the cache so they do not
+// push out everything else
+#define BCACHE_MAX_READ (64 << 10)
+
+// File reads up to this size are served from the cache rather than handed
+// to FUSE as ranges of the image
+#define BCACHE_SMALL_READ (16 << 10)
+
+struct bcache_page {
+    off_t offset;               // of the page in the image, -1 for a free slot
+    int referenced;             // read since the hand last passed
+    int pins;                   // reads filling the page
+    int valid;                  // filled, and current
+    int stale;                  // written to while being filled
+    struct bcache_page *hash_next;
+};
+
+pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+struct bcache_page *bcache_pages;
+char *bcache_data;
+size_t bcache_num_pages;
+struct bcache_page **bcache_buckets;
+size_t bcache_num_buckets;
+size_t bcache_hand;
+unsigned long bcache_hits;
+unsigned long bcache_misses;
+unsigned long bcache_evictions;
+
+int bcache_init(size_t max_bytes) {
+    bcache_num_pages = max_bytes / BCACHE_PAGE_SIZE;
+    if (bcache_num_pages == 0) {
+        return 0;
+    }
+    bcache_num_buckets = 64;
+    while (bcache_num_buckets < bcache_num_pages) {
+        bcache_num_buckets *= 2;
+    }
+    bcache_pages = malloc(sizeof(struct bcache_page) * bcache_num_pages);
+    bcache_data = malloc(bcache_num_pages * BCACHE_PAGE_SIZE);
+    bcache_buckets = calloc(bcache_num_buckets, sizeof(struct bcache_page *));
+    if (bcache_pages == NULL || bcache_data == NULL || bcache_buckets == NULL) {
+        perror("Error allocating block cache");
+        free(bcache_pages);
+        free(bcache_data);
+        free(bcache_buckets);
+        bcache_pages = NULL;
+        return -1;
+    }
+    for (size_t i = 0; i < bcache_num_pages; i++) {
+        bcache_pages[i] = (struct bcache_page) { .offset = -1 };
+    }
+    return 0;
+}
+
+struct bcache_page **bcache_find_slot(off_t offset) {
+    struct bcache_page **slot = &bcache_buckets[(offset / BCACHE_PAGE_SIZE) & (bcache_num_buckets - 1)];
+    while (*slot != NULL && (*slot)->offset != offset) {
+        slot = &(*slot)->hash_next;
+    }
+    return slot;
+}
+
+char *bcache_page_data(struct bcache_page *page) {
+    return bcache_data + (page - bcache_pages) * BCACHE_PAGE_SIZE;
+}
+
+void bcache_drop(struct bcache_page *page) {
+    *bcache_find_slot(page->offset) = page->hash_next;
+    page->offset = -1;
+    page->valid = 0;
+}
+
+// Take a slot for the page at offset and return it pinned, or NULL if
+// every slot is pinned. Called with bcache_lock held.
+struct bcache_page *bcache_claim(off_t offset) {
+    for (size_t i = 0; i < 2 * bcache_num_pages; i++) {
+        struct bcache_page *page = &bcache_pages[bcache_hand];
+        bcache_hand = (bcache_hand + 1) % bcache_num_pages;
+        if (page->pins != 0) {
+            continue;
+        }
+        if (page->offset != -1) {
+            if (page->referenced) {
+                page->referenced = 0;
+                continue;
             }
+            bcache_drop(page);
+            bcache_evictions++;
+        }
+        *page = (struct bcache_page) { .offset = offset, .pins = 1 };
+        struct bcache_page **slot = bcache_find_slot(offset);
+        page->hash_next = *slot;
+        *slot = page;
+        return page;
+    }
+    return NULL;
+}
 
-            if (pread(fd, latest_entry, entry_size, current_offset) != entry_size) {
-                perror("Error reading log entry");
-                free(latest_entry);
-                latest_entry = NULL;
+ssize_t bcache_read(void *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        off_t page_offset = (offset + done) / BCACHE_PAGE_SIZE * BCACHE_PAGE_SIZE;
+        size_t in_page = offset + done - page_offset;
+        size_t length = BCACHE_PAGE_SIZE - in_page < size - done ? BCACHE_PAGE_SIZE - in_page : size - done;
+
+        pthread_mutex_lock(&bcache_lock);
+        struct bcache_page *page = *bcache_find_slot(page_offset);
+        if (page != NULL && page->valid) {
+            page->referenced = 1;
+            bcache_hits++;
+            memcpy((char *)buf + done, bcache_page_data(page) + in_page, length);
+            pthread_mutex_unlock(&bcache_lock);
+            done += length;
+            continue;
+        }
+        bcache_misses++;
+        // A page another read is filling is read around
+        page = page == NULL ? bcache_claim(page_offset) : NULL;
+        pthread_mutex_unlock(&bcache_lock);
+
+        ssize_t ret = -1;
+        if (page != NULL) {
+            ret = read_image(bcache_page_data(page), BCACHE_PAGE_SIZE, page_offset);
+            pthread_mutex_lock(&bcache_lock);
+            page->pins--;
+            if (ret == BCACHE_PAGE_SIZE && !page->stale) {
+                page->valid = 1;
+                memcpy((char *)buf + done, bcache_page_data(page) + in_page, length);
+            } else {
+                bcache_drop(page);
+            }
+            pthread_mutex_unlock(&bcache_lock);
+        }
+        if (ret != BCACHE_PAGE_SIZE) {
+            // Short at the end of the disk, or not cacheable right now
+            ret = read_image((char *)buf + done, length, offset + done);
+            if (ret < 0) {
+                return done != 0 ? done : ret;
+            }
+            done += ret;
+            if (ret != length) {
                 break;
             }
+            continue;
+        }
+        done += length;
+    }
+    return done;
+}
+
+// Bring cached pages in [offset, offset + size) up to date with a write
+void bcache_write(const void *buf, size_t size, off_t offset) {
+    pthread_mutex_lock(&bcache_lock);
+    off_t end = offset + size;
+    for (off_t page_offset = offset / BCACHE_PAGE_SIZE * BCACHE_PAGE_SIZE; page_offset < end; page_offset += BCACHE_PAGE_SIZE) {
+        struct bcache_page *page = *bcache_find_slot(page_offset);
+        if (page == NULL) {
+            continue;
+        }
+        if (!page->valid) {
+            page->stale = 1;
+            continue;
+        }
+        off_t start = page_offset > offset ? page_offset : offset;
+        off_t stop = page_offset + BCACHE_PAGE_SIZE < end ? page_offset + BCACHE_PAGE_SIZE : end;
+        memcpy(bcache_page_data(page) + (start - page_offset), (const char *)buf + (start - offset), stop - start);
+    }
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+// pread() and pwrite() for the disk image, which copy to and from its
+// mapping instead when there is one. Like them they return the number of
+// bytes transferred, short at the end of the disk. Without a mapping,
+// reads go through the block cache and writes are queued.
+ssize_t disk_pread(int fd, void *buf, size_t size, off_t offset) {
+    if (fd != disk_fd) {
+        return pread(fd, buf, size, offset);
+    }
+    if (disk_map == NULL) {
+        if (bcache_pages != NULL && size <= BCACHE_MAX_READ) {
+            return bcache_read(buf, size, offset);
+        }
+        return read_image(buf, size, offset);
+    }
+    if (offset >= disk_size) {
+        return 0;
+    }
+    if (size > disk_size - offset) {
+        size = disk_size - offset;
+    }
+    memcpy(buf, disk_map + offset, size);
+    return size;
+}
+
+ssize_t disk_pwrite(int fd, const void *buf, size_t size, off_t offset) {
+    if (fd != disk_fd) {
+        return pwrite(fd, buf, size, offset);
+    }
+    if (offset >= disk_size) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (size > disk_size - offset) {
+        size = disk_size - offset;
+    }
+    if (disk_map == NULL) {
+        if (bcache_pages != NULL) {
+            bcache_write(buf, size, offset);
+        }
+        struct queued_write *last = num_queued_writes ? &queued_writes[num_queued_writes - 1] : NULL;
+        int merge = last != NULL && last->offset + last->len == offset;
+        if (!merge && num_queued_writes == MAX_QUEUED_WRITES && submit_writes(0) != 0) {
+            errno = EIO;
+            return -1;
+        }
+        if (write_queue_len + size > write_queue_cap) {
+            size_t new_cap = write_queue_cap ? write_queue_cap : WRITE_QUEUE_SIZE;
+            while (new_cap < write_queue_len + size) {
+                new_cap *= 2;
+            }
+            char *new_queue = realloc(write_queue, new_cap);
+            if (new_queue == NULL) {
+                return -1;
+            }
+            write_queue = new_queue;
+            write_queue_cap = new_cap;
+        }
+        memcpy(write_queue + write_queue_len, buf, size);
+        if (merge && num_queued_writes != 0) {
+            queued_writes[num_queued_writes - 1].len += size;
+        } else {
+            queued_writes[num_queued_writes++] = (struct queued_write) { offset, write_queue_len, size };
+        }
+        write_queue_len += size;
+        disk_written_gen++;
+        if (write_queue_len >= WRITE_QUEUE_SIZE && submit_writes(0) != 0) {
+            errno = EIO;
+            return -1;
+        }
+        return size;
+    }
+    memcpy(disk_map + offset, buf, size);
+    disk_written_gen++;
+    if (map_dirty_start >= map_dirty_end) {
+        map_dirty_start = offset;
+        map_dirty_end = offset + size;
+    } else {
+        map_dirty_start = offset < map_dirty_start ? offset : map_dirty_start;
+        map_dirty_end = offset + size > map_dirty_end ? offset + size : map_dirty_end;
+    }
+    return size;
+}
+
+// pwritev() for the disk image. Without a mapping the segments join the
+// queue as one contiguous write.
+ssize_t disk_pwritev(int fd, const struct iovec *iov, int count, off_t offset) {
+    if (fd != disk_fd) {
+        return pwritev(fd, iov, count, offset);
+    }
+    ssize_t total = 0;
+    for (int i = 0; i < count; i++) {
+        ssize_t ret = disk_pwrite(fd, iov[i].iov_base, iov[i].iov_len, offset + total);
+        if (ret < 0) {
+            return ret;
+        }
+        total += ret;
+        if (ret != iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+// Make everything written to the disk image durable. With a mapping, only
+// the pages written through it since the last sync are flushed.
+int disk_sync(void) {
+    pthread_mutex_lock(&sync_lock);
+    uint64_t gen = disk_written_gen;
+    int ret = 0;
+    if (disk_synced_gen < gen) {
+        if (disk_map == NULL) {
+            ret = submit_writes(1);
+        } else if (map_dirty_start < map_dirty_end) {
+            off_t start = map_dirty_start - map_dirty_start % sysconf(_SC_PAGESIZE);
+            ret = msync(disk_map + start, map_dirty_end - start, MS_SYNC);
+            if (ret == 0) {
+                map_dirty_start = map_dirty_end = 0;
+            }
+        } else {
+            ret = fdatasync(disk_fd); // Written before the mapping was made
+        }
+        if (ret == 0) {
+            disk_synced_gen = gen;
+        }
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return ret;
+}
+
+// disk_sync() in two halves, so that other operations go on while the disk
+// is flushed. disk_sync_begin() runs under wfs_lock, hands queued writes
+// to the kernel and sets *gen to what disk_sync_end() must make durable.
+// disk_sync_end() runs without wfs_lock.
+int disk_sync_begin(uint64_t *gen) {
+    *gen = disk_written_gen;
+    if (disk_map == NULL && num_queued_writes != 0 && submit_writes(0) != 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+int disk_sync_end(uint64_t gen) {
+    pthread_mutex_lock(&sync_lock);
+    int ret = 0;
+    if (disk_synced_gen < gen) {
+        // This covers the whole image, pages written through a mapping too
+        if (fdatasync(disk_fd) != 0) {
+            perror("Error syncing disk");
+            ret = -EIO;
+        } else {
+            disk_synced_gen = gen;
         }
-        // Move to the next log entry
-        current_offset += entry_size;
     }
-    //Print current offset
-    return latest_entry; // Return the latest entry found or NULL if none
+    pthread_mutex_unlock(&sync_lock);
+    return ret;
+}
+
+// The entry at offset, in place in the mapping, or NULL without one or if
+// the entry would run past the end of the disk
+const struct wfs_log_entry *disk_entry(off_t offset) {
+    if (disk_map == NULL || offset < WFS_SB_SIZE(&sb) || offset + sizeof(struct wfs_inode) > disk_size) {
+        return NULL;
+    }
+    const struct wfs_log_entry *entry = (const struct wfs_log_entry *)(disk_map + offset);
+    if (entry->inode.size > disk_size - offset - sizeof(struct wfs_inode)) {
+        return NULL;
+    }
+    return entry;
 }
 
-// Function to read a log entry from the disk at a given offset
 struct wfs_log_entry *read_log_entry(int fd, off_t offset)
 {
     // Read the inode first to determine the size of the log entry
     struct wfs_inode inode;
-    if (pread(fd, &inode, sizeof(struct wfs_inode), offset) != sizeof(struct wfs_inode))
+    if (disk_pread(fd, &inode, sizeof(struct wfs_inode), offset) != sizeof(struct wfs_inode))
     {
         perror("Error reading inode");
         // printf("Error reading inode\n");
@@ -85,7 +876,7 @@ struct wfs_log_entry *read_log_entry(int fd, off_t offset)
     }
 
     // Read the entire log entry (inode + data) into memory
-    if (pread(fd, entry, log_entry_size, offset) != log_entry_size)
+    if (disk_pread(fd, entry, log_entry_size, offset) != log_entry_size)
     {
         perror("Error reading log entry");
         free(entry);
@@ -95,82 +886,1513 @@ struct wfs_log_entry *read_log_entry(int fd, off_t offset)
     return entry;
 }
 
+// The entry at offset, in place in the mapping if there is one, and
+// otherwise read into memory as *copy for the caller to free
+const struct wfs_log_entry *get_log_entry(off_t offset, struct wfs_log_entry **copy) {
+    const struct wfs_log_entry *entry = disk_entry(offset);
+    *copy = entry == NULL ? read_log_entry(disk_fd, offset) : NULL;
+    return entry != NULL ? entry : *copy;
+}
 
-unsigned int find_inode_number(const char *path) {
-    if (disk_fd == -1) {
-        perror("Error opening filesystem image");
-        return -1;
+// Block and indirect entries are only reachable through a block map, and
+// commit records and checkpoints belong to no inode, so none of them ever
+// becomes the latest entry of an inode
+int is_inode_entry(const struct wfs_inode *inode) {
+    return inode->flags == WFS_ENTRY_FULL || inode->flags == WFS_ENTRY_DELTA ||
+           inode->flags == WFS_ENTRY_BMAP || inode->flags == WFS_ENTRY_DIR_DELTA;
+}
+
+// Read the header of an inode's latest entry. For deltas and block maps,
+// inode->size is set to the size of the file or directory rather than the
+// size of the entry. Deltas of either kind are reported as WFS_ENTRY_FULL
+// with *depth set to the number of deltas since the last full entry.
+int load_inode(unsigned int inode_number, struct wfs_inode *inode, unsigned int *depth) {
+    off_t offset = inode_map_get(inode_number);
+    if (offset == 0) {
+        return -ENOENT;
+    }
+    if (disk_pread(disk_fd, inode, sizeof(struct wfs_inode), offset) != sizeof(struct wfs_inode)) {
+        perror("Error reading inode");
+        return -EIO;
+    }
+    *depth = 0;
+    if (inode->flags == WFS_ENTRY_DELTA) {
+        struct wfs_delta delta;
+        if (disk_pread(disk_fd, &delta, sizeof(delta), offset + sizeof(struct wfs_inode)) != sizeof(delta)) {
+            perror("Error reading delta");
+            return -EIO;
+        }
+        inode->flags = WFS_ENTRY_FULL;
+        inode->size = delta.file_size;
+        *depth = delta.depth;
+    } else if (inode->flags == WFS_ENTRY_DIR_DELTA) {
+        struct wfs_dir_delta delta;
+        if (disk_pread(disk_fd, &delta, sizeof(delta), offset + sizeof(struct wfs_inode)) != sizeof(delta)) {
+            perror("Error reading directory delta");
+            return -EIO;
+        }
+        inode->flags = WFS_ENTRY_FULL;
+        inode->size = delta.dir_size;
+        *depth = delta.depth;
+    } else if (inode->flags == WFS_ENTRY_BMAP) {
+        uint32_t file_size;
+        if (disk_pread(disk_fd, &file_size, sizeof(file_size), offset + sizeof(struct wfs_inode)) != sizeof(file_size)) {
+            perror("Error reading block map");
+            return -EIO;
+        }
+        inode->size = file_size;
     }
+    return 0;
+}
 
-    // If the path is the root directory, handle it as a special case
-    if (strcmp(path, "/") == 0) {
+// load_inode() through the copy cached in an open handle, if there is one
+int get_inode(unsigned int inode_number, struct wfs_handle *handle, struct wfs_inode *inode, unsigned int *depth) {
+    if (handle == NULL) {
+        return load_inode(inode_number, inode, depth);
+    }
+    off_t offset = inode_map_get(inode_number);
+    pthread_mutex_lock(&cache_lock);
+    int hit = offset != 0 && offset == handle->entry_offset;
+    if (hit) {
+        *inode = handle->inode;
+        *depth = handle->depth;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (hit) {
         return 0;
     }
 
-    // Tokenize the path
-    char *path_copy = strdup(path);
-    if (path_copy == NULL) {
-        perror("Failed to duplicate path");
-        return -1;
+    int ret = load_inode(inode_number, inode, depth);
+    if (ret == 0) {
+        pthread_mutex_lock(&cache_lock);
+        handle->inode = *inode;
+        handle->depth = *depth;
+        handle->entry_offset = offset;
+        pthread_mutex_unlock(&cache_lock);
     }
+    return ret;
+}
 
-    char *token = strtok(path_copy, "/");
-    unsigned int current_inode_number = 0;
-
-    while (token != NULL) {
-        struct wfs_log_entry *entry = find_last_log_entry(disk_fd, current_inode_number);
-        if (entry == NULL) {
-           // The entry doesn't exist
-            free(path_copy);
-            return -1; 
+// Rebuild a directory from the chain of changes ending at entry, which is
+// consumed
+struct wfs_log_entry *load_directory(int fd, unsigned int inode_number, struct wfs_log_entry *entry) {
+    // Collect the changes newest first until the full entry they apply to
+    unsigned int depth = ((struct wfs_dir_delta *)entry->data)->depth;
+    struct wfs_log_entry **deltas = malloc(sizeof(struct wfs_log_entry *) * depth);
+    if (deltas == NULL) {
+        free(entry);
+        return NULL;
+    }
+    unsigned int num_deltas = 0;
+    struct wfs_log_entry *base = entry;
+    while (base != NULL && base->inode.flags == WFS_ENTRY_DIR_DELTA) {
+        if (num_deltas == depth) {
+            fprintf(stderr, "Directory delta chain of inode %u is longer than recorded\n", inode_number);
+            free(base);
+            base = NULL;
+            break;
         }
+        deltas[num_deltas++] = base;
+        base = read_log_entry(fd, ((struct wfs_dir_delta *)base->data)->prev);
+    }
 
-        // Check if it's a regular file and matches the last component of the path
-        if (S_ISREG(entry->inode.mode) && strcmp(token, path_copy) == 0) {
-            unsigned int file_inode_number = entry->inode.inode_number;
-            free(entry);
-            free(path_copy);
-            return file_inode_number;
-        }
-
-        // If it's a directory, iterate over the directory entries
-        if (S_ISDIR(entry->inode.mode)) {
-            struct wfs_dentry *dentries = (struct wfs_dentry *)(entry->data);
-            size_t num_dentries = entry->inode.size / sizeof(struct wfs_dentry);
-            unsigned int next_inode_number = -1;
-            for (size_t i = 0; i < num_dentries; i++) {
-                if (strcmp(dentries[i].name, token) == 0) {
-                    next_inode_number = dentries[i].inode_number;
+    // Room for every dentry the directory ever holds along the way
+    struct wfs_log_entry *dir_entry = NULL;
+    if (base != NULL) {
+        dir_entry = malloc(sizeof(struct wfs_inode) + base->inode.size + sizeof(struct wfs_dentry) * num_deltas);
+    }
+    if (dir_entry != NULL) {
+        dir_entry->inode = deltas[0]->inode;
+        dir_entry->inode.flags = WFS_ENTRY_FULL;
+        memcpy(dir_entry->data, base->data, base->inode.size);
+        struct wfs_dentry *dentries = (struct wfs_dentry *)dir_entry->data;
+        size_t num_dentries = base->inode.size / sizeof(struct wfs_dentry);
+
+        // Apply the changes oldest first
+        for (unsigned int i = num_deltas; i-- > 0;) {
+            struct wfs_dir_delta *delta = (struct wfs_dir_delta *)deltas[i]->data;
+            if (!delta->removed) {
+                dentries[num_dentries++] = delta->dentry;
+                continue;
+            }
+            for (size_t j = 0; j < num_dentries; j++) {
+                if (strcmp(dentries[j].name, delta->dentry.name) == 0) {
+                    memmove(&dentries[j], &dentries[j + 1], sizeof(struct wfs_dentry) * (num_dentries - j - 1));
+                    num_dentries--;
                     break;
                 }
             }
+        }
+        dir_entry->inode.size = num_dentries * sizeof(struct wfs_dentry);
+    }
 
-            if (next_inode_number == -1) {
-                // The next component of the path was not found in the current directory
-                free(entry);
-                free(path_copy);
-                return -1;
-            }
+    for (unsigned int i = 0; i < num_deltas; i++) {
+        free(deltas[i]);
+    }
+    free(deltas);
+    free(base);
+    return dir_entry;
+}
 
-            // Move to the next component of the path
-            current_inode_number = next_inode_number;
-        } else {
-            // Not a directory or a matching file
-            free(entry);
-            free(path_copy);
-            return -1;
+// Load the current contents of an inode as a full log entry, applying any
+// deltas on top of its last full entry. Returns NULL if it has none.
+struct wfs_log_entry *find_last_log_entry(int fd, unsigned int inode_number) {
+    off_t offset = inode_map_get(inode_number);
+    if (offset == 0) {
+        return NULL;
+    }
+    struct wfs_log_entry *entry = read_log_entry(fd, offset);
+    if (entry != NULL && entry->inode.flags == WFS_ENTRY_DIR_DELTA) {
+        return load_directory(fd, inode_number, entry);
+    }
+    if (entry == NULL || entry->inode.flags != WFS_ENTRY_DELTA) {
+        return entry;
+    }
+
+    // Collect the deltas newest first until the full entry they apply to
+    unsigned int depth = ((struct wfs_delta *)entry->data)->depth;
+    struct wfs_log_entry **deltas = malloc(sizeof(struct wfs_log_entry *) * depth);
+    if (deltas == NULL) {
+        free(entry);
+        return NULL;
+    }
+    unsigned int num_deltas = 0;
+    struct wfs_log_entry *base = entry;
+    while (base != NULL && base->inode.flags == WFS_ENTRY_DELTA) {
+        if (num_deltas == depth) {
+            fprintf(stderr, "Delta chain of inode %u is longer than recorded\n", inode_number);
+            free(base);
+            base = NULL;
+            break;
         }
+        deltas[num_deltas++] = base;
+        base = read_log_entry(fd, ((struct wfs_delta *)base->data)->prev);
+    }
 
-        token = strtok(NULL, "/");
+    // A chain that broke off leaves no base, and maybe no deltas either
+    struct wfs_delta *latest = NULL;
+    struct wfs_log_entry *file_entry = NULL;
+    if (base != NULL) {
+        latest = (struct wfs_delta *)deltas[0]->data;
+        file_entry = malloc(sizeof(struct wfs_inode) + latest->file_size);
+    }
+    if (file_entry != NULL) {
+        file_entry->inode = deltas[0]->inode;
+        file_entry->inode.flags = WFS_ENTRY_FULL;
+        file_entry->inode.size = latest->file_size;
+
+        size_t base_size = base->inode.size < latest->file_size ? base->inode.size : latest->file_size;
+        memcpy(file_entry->data, base->data, base_size);
+        memset(file_entry->data + base_size, 0, latest->file_size - base_size);
+
+        // Apply the deltas oldest first
+        for (unsigned int i = num_deltas; i-- > 0;) {
+            struct wfs_delta *delta = (struct wfs_delta *)deltas[i]->data;
+            size_t length = delta->length;
+            if (delta->offset >= latest->file_size) {
+                continue;
+            }
+            if (delta->offset + length > latest->file_size) {
+                length = latest->file_size - delta->offset;
+            }
+            memcpy(file_entry->data + delta->offset, (char *)(delta + 1), length);
+        }
     }
 
-    free(path_copy);
-    return current_inode_number; // Return the inode number of the final path component
+    for (unsigned int i = 0; i < num_deltas; i++) {
+        free(deltas[i]);
+    }
+    free(deltas);
+    free(base);
+    return file_entry;
 }
 
-
-
-/*
+// Copy [offset, offset + size) of an inline file into buf, reading only
+// those bytes of its last full entry and of the deltas that overlap them.
+// The range must lie within the file.
+int read_inline_file(unsigned int inode_number, char *buf, size_t size, off_t offset) {
+    struct wfs_inode inode;
+    off_t entry_offset = inode_map_get(inode_number);
+    struct wfs_delta *deltas = NULL;
+    off_t *delta_offsets = NULL;
+    unsigned int num_deltas = 0;
+    int ret = 0;
+
+    // Walk back to the full entry, remembering the deltas on the way
+    for (;;) {
+        if (disk_pread(disk_fd, &inode, sizeof(inode), entry_offset) != sizeof(inode)) {
+            perror("Error reading inode");
+            ret = -EIO;
+            goto out;
+        }
+        if (inode.flags != WFS_ENTRY_DELTA) {
+            break;
+        }
+        struct wfs_delta delta;
+        if (disk_pread(disk_fd, &delta, sizeof(delta), entry_offset + sizeof(inode)) != sizeof(delta)) {
+            perror("Error reading delta");
+            ret = -EIO;
+            goto out;
+        }
+        if (deltas == NULL) {
+            if (delta.depth == 0) {
+                fprintf(stderr, "Delta chain of inode %u is longer than recorded\n", inode_number);
+                ret = -EIO;
+                goto out;
+            }
+            deltas = malloc(sizeof(struct wfs_delta) * delta.depth);
+            delta_offsets = malloc(sizeof(off_t) * delta.depth);
+            if (deltas == NULL || delta_offsets == NULL) {
+                ret = -ENOMEM;
+                goto out;
+            }
+        } else if (num_deltas == deltas[0].depth) {
+            fprintf(stderr, "Delta chain of inode %u is longer than recorded\n", inode_number);
+            ret = -EIO;
+            goto out;
+        }
+        deltas[num_deltas] = delta;
+        delta_offsets[num_deltas] = entry_offset;
+        num_deltas++;
+        entry_offset = delta.prev;
+    }
+
+    size_t base_size = 0;
+    if (offset < inode.size) {
+        base_size = inode.size - offset < size ? inode.size - offset : size;
+    }
+    if (disk_pread(disk_fd, buf, base_size, entry_offset + sizeof(inode) + offset) != base_size) {
+        perror("Error reading log entry");
+        ret = -EIO;
+        goto out;
+    }
+    memset(buf + base_size, 0, size - base_size);
+
+    // Apply the overlapping part of each delta, oldest first
+    for (unsigned int i = num_deltas; i-- > 0;) {
+        off_t start = deltas[i].offset > offset ? deltas[i].offset : offset;
+        off_t end = deltas[i].offset + deltas[i].length;
+        if (end > offset + size) {
+            end = offset + size;
+        }
+        if (start >= end) {
+            continue;
+        }
+        off_t data_offset = delta_offsets[i] + sizeof(struct wfs_inode) + sizeof(struct wfs_delta) + (start - deltas[i].offset);
+        if (disk_pread(disk_fd, buf + (start - offset), end - start, data_offset) != end - start) {
+            perror("Error reading delta");
+            ret = -EIO;
+            goto out;
+        }
+    }
+
+out:
+    free(deltas);
+    free(delta_offsets);
+    return ret;
+}
+
+// CRC-32 (IEEE) of len bytes, continuing from a previous result or 0
+uint32_t crc32(uint32_t crc, const void *buf, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while (len--) {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Entries appended since the last commit record, see commit_log()
+off_t batch_start;
+uint32_t batch_crc;
+// Superblock as last written to the disk
+struct wfs_sb sb_on_disk;
+// Bytes of entries appended or replayed since the latest checkpoint
+off_t log_since_checkpoint;
+
+#define COMMIT_RECORD_SIZE (sizeof(struct wfs_inode) + sizeof(struct wfs_commit))
+
+// Set while the cleaner appends copies, which may use clean_reserve
+int cleaning;
+// Whether the log is cleaned at all: version 2 images with a clean_rate
+int cleaner_enabled;
+// Free space kept back from operations for the cleaner's copies
+off_t clean_reserve;
+// Bytes appended by operations, as opposed to the cleaner
+off_t op_bytes_appended;
+
+// Where the log goes on after an entry that ends at offset. Entries never
+// run past the end of the disk, and once less than a header is left there
+// the log goes on at its start, unless it ends right there.
+off_t log_next(off_t offset) {
+    if (offset != sb.head && offset + sizeof(struct wfs_inode) > disk_size) {
+        return WFS_SB_SIZE(&sb);
+    }
+    return offset;
+}
+
+// Bytes between the head and the tail that are free to append to
+off_t log_free_space(void) {
+    if (sb.head < sb.tail) {
+        return sb.tail - sb.head;
+    }
+    return disk_size - sb.head + sb.tail - WFS_SB_SIZE(&sb);
+}
+
+// Go on at the start of the log. The rest of the disk is filled with a wrap
+// entry, if there is room for one, whose header joins the batch's CRC.
+int wrap_log(void) {
+    off_t left = disk_size - sb.head;
+    if (left >= sizeof(struct wfs_inode)) {
+        struct wfs_inode marker = {0};
+        marker.flags = WFS_ENTRY_WRAP;
+        marker.size = left - sizeof(marker);
+        if (disk_pwrite(disk_fd, &marker, sizeof(marker), sb.head) != sizeof(marker)) {
+            perror("Error appending log entry");
+            return -EIO;
+        }
+        batch_crc = crc32(batch_crc, &marker, sizeof(marker));
+    }
+    sb.head = WFS_SB_SIZE(&sb);
+    return 0;
+}
+
+// Append entries back to back with a single write, so that the records of
+// one operation land in the same batch, and record them in the inode map.
+// Either all of them are appended or none is. Returns the offset of the
+// first, or a negative errno.
+off_t append_log_entries(const struct wfs_log_entry **entries, const size_t *sizes, int count) {
+    struct iovec iov[count];
+    size_t total_size = 0;
+    for (int i = 0; i < count; i++) {
+        // The map has room for every entry before anything is written
+        if (is_inode_entry(&entries[i]->inode) && inode_map_grow(entries[i]->inode.inode_number) != 0) {
+            return -ENOMEM;
+        }
+        iov[i].iov_base = (void *)entries[i];
+        iov[i].iov_len = sizes[i];
+        total_size += sizes[i];
+    }
+    // Always leave room to commit the batch these entries join
+    size_t reserve = entries[0]->inode.flags == WFS_ENTRY_COMMIT ? 0 : COMMIT_RECORD_SIZE;
+    if (cleaner_enabled && !cleaning && reserve != 0 &&
+        log_free_space() < total_size + reserve + clean_reserve) {
+        return -ENOSPC;
+    }
+    // Entries and the room reserved after them never straddle the end of
+    // the disk, and the head never catches up with the tail
+    off_t write_offset = sb.head;
+    if (write_offset >= sb.tail && write_offset + total_size + reserve > disk_size) {
+        write_offset = WFS_SB_SIZE(&sb);
+        if (write_offset + total_size + reserve >= sb.tail) {
+            return -ENOSPC;
+        }
+        if (wrap_log() != 0) {
+            return -EIO;
+        }
+    } else if (write_offset < sb.tail && write_offset + total_size + reserve >= sb.tail) {
+        return -ENOSPC;
+    }
+    if (disk_pwritev(disk_fd, iov, count, write_offset) != total_size) {
+        perror("Error appending log entry");
+        return -EIO;
+    }
+
+    off_t entry_offset = write_offset;
+    for (int i = 0; i < count; i++) {
+        const struct wfs_log_entry *entry = entries[i];
+        sb.head += sizes[i];
+        if (!cleaning) {
+            op_bytes_appended += sizes[i];
+        }
+        batch_crc = crc32(batch_crc, entry, sizes[i]);
+        if (entry->inode.flags != WFS_ENTRY_COMMIT) {
+            log_since_checkpoint += sizes[i];
+        }
+        if (is_inode_entry(&entry->inode)) {
+            inode_map[entry->inode.inode_number] = entry->inode.deleted ? 0 : entry_offset;
+        }
+        entry_offset += sizes[i];
+    }
+    return write_offset;
+}
+
+// Append a log entry at the head and record it in the inode map.
+// Returns the offset it was written at, or a negative errno.
+off_t append_log_entry(const struct wfs_log_entry *entry, size_t entry_size) {
+    return append_log_entries(&entry, &entry_size, 1);
+}
+
+// Directory index: every name of a large directory hashed in memory. It is
+// built the first time a lookup has to read such a directory, and kept
+// current by dir_delta_appended(), so a miss is final and the directory is
+// not read again. Least recently used indexes are dropped once their memory
+// passes config.dir_index_size.
+#define DIR_INDEX_MIN_ENTRIES 64
+
+struct dir_index_entry {
+    char name[MAX_FILE_NAME_LEN];
+    unsigned int inode_number;
+    struct dir_index_entry *next;
+};
+
+struct dir_index {
+    unsigned int inode_number;  // of the directory
+    struct dir_index_entry **buckets;
+    size_t num_buckets;         // a power of two
+    size_t count;
+    struct dir_index *next;     // in dir_indexes
+};
+
+// All indexes, most recently used first. Only large directories get one,
+// so the list stays short.
+struct dir_index *dir_indexes;
+size_t dir_index_bytes;
+
+size_t dir_index_hash(const char *name) {
+    // FNV-1a over the name
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = name; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+struct dir_index *dir_index_find(unsigned int inode_number) {
+    for (struct dir_index **link = &dir_indexes; *link != NULL; link = &(*link)->next) {
+        struct dir_index *index = *link;
+        if (index->inode_number == inode_number) {
+            *link = index->next;
+            index->next = dir_indexes;
+            dir_indexes = index;
+            return index;
+        }
+    }
+    return NULL;
+}
+
+// Returns the inode number, or -1 if the name is absent
+unsigned int dir_index_lookup(const struct dir_index *index, const char *name) {
+    struct dir_index_entry *entry = index->buckets[dir_index_hash(name) & (index->num_buckets - 1)];
+    while (entry != NULL && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    return entry ? entry->inode_number : -1;
+}
+
+void dir_index_free(struct dir_index *index) {
+    for (size_t i = 0; i < index->num_buckets; i++) {
+        while (index->buckets[i] != NULL) {
+            struct dir_index_entry *entry = index->buckets[i];
+            index->buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    dir_index_bytes -= sizeof(struct dir_index) + sizeof(struct dir_index_entry *) * index->num_buckets +
+                       sizeof(struct dir_index_entry) * index->count;
+    free(index->buckets);
+    free(index);
+}
+
+// Drop the index of a directory, for when it can no longer be kept current
+void dir_index_drop(unsigned int inode_number) {
+    struct dir_index *index = dir_index_find(inode_number);
+    if (index != NULL) {
+        dir_indexes = index->next;
+        dir_index_free(index);
+    }
+}
+
+int dir_index_add(struct dir_index *index, const char *name, unsigned int inode_number) {
+    if (index->count >= index->num_buckets) {
+        // Keep chains short by doubling the table
+        size_t new_num_buckets = index->num_buckets * 2;
+        struct dir_index_entry **new_buckets = calloc(new_num_buckets, sizeof(struct dir_index_entry *));
+        if (new_buckets == NULL) {
+            return -ENOMEM;
+        }
+        for (size_t i = 0; i < index->num_buckets; i++) {
+            while (index->buckets[i] != NULL) {
+                struct dir_index_entry *entry = index->buckets[i];
+                index->buckets[i] = entry->next;
+                size_t bucket = dir_index_hash(entry->name) & (new_num_buckets - 1);
+                entry->next = new_buckets[bucket];
+                new_buckets[bucket] = entry;
+            }
+        }
+        free(index->buckets);
+        dir_index_bytes += sizeof(struct dir_index_entry *) * (new_num_buckets - index->num_buckets);
+        index->buckets = new_buckets;
+        index->num_buckets = new_num_buckets;
+    }
+
+    struct dir_index_entry *entry = malloc(sizeof(struct dir_index_entry));
+    if (entry == NULL) {
+        return -ENOMEM;
+    }
+    strncpy(entry->name, name, MAX_FILE_NAME_LEN - 1);
+    entry->name[MAX_FILE_NAME_LEN - 1] = '\0';
+    entry->inode_number = inode_number;
+    size_t bucket = dir_index_hash(entry->name) & (index->num_buckets - 1);
+    entry->next = index->buckets[bucket];
+    index->buckets[bucket] = entry;
+    index->count++;
+    dir_index_bytes += sizeof(struct dir_index_entry);
+    return 0;
+}
+
+void dir_index_remove(struct dir_index *index, const char *name) {
+    struct dir_index_entry **link = &index->buckets[dir_index_hash(name) & (index->num_buckets - 1)];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        struct dir_index_entry *entry = *link;
+        *link = entry->next;
+        free(entry);
+        index->count--;
+        dir_index_bytes -= sizeof(struct dir_index_entry);
+    }
+}
+
+// Index the dentries of a directory just read from the log. Returns NULL
+// if it is too small to be worth it or the index could not be built.
+struct dir_index *dir_index_build(unsigned int inode_number, const struct wfs_dentry *dentries, size_t num_dentries) {
+    size_t bytes = sizeof(struct dir_index) + (sizeof(struct dir_index_entry *) + sizeof(struct dir_index_entry)) * num_dentries;
+    if (num_dentries < DIR_INDEX_MIN_ENTRIES || bytes > config.dir_index_size) {
+        return NULL;
+    }
+    // Make room by dropping the least recently used indexes
+    while (dir_indexes != NULL && dir_index_bytes + bytes > config.dir_index_size) {
+        struct dir_index **link = &dir_indexes;
+        while ((*link)->next != NULL) {
+            link = &(*link)->next;
+        }
+        dir_index_free(*link);
+        *link = NULL;
+    }
+
+    struct dir_index *index = calloc(1, sizeof(struct dir_index));
+    if (index == NULL) {
+        return NULL;
+    }
+    index->inode_number = inode_number;
+    index->num_buckets = DIR_INDEX_MIN_ENTRIES;
+    while (index->num_buckets < num_dentries) {
+        index->num_buckets *= 2;
+    }
+    index->buckets = calloc(index->num_buckets, sizeof(struct dir_index_entry *));
+    if (index->buckets == NULL) {
+        free(index);
+        return NULL;
+    }
+    dir_index_bytes += sizeof(struct dir_index) + sizeof(struct dir_index_entry *) * index->num_buckets;
+    for (size_t i = 0; i < num_dentries; i++) {
+        if (dir_index_add(index, dentries[i].name, dentries[i].inode_number) != 0) {
+            dir_index_free(index);
+            return NULL;
+        }
+    }
+    index->next = dir_indexes;
+    dir_indexes = index;
+    return index;
+}
+
+// Directories whose latest entry may be a change rather than a full entry.
+// They are folded at the next checkpoint. Duplicates are harmless.
+unsigned int *delta_dirs;
+size_t num_delta_dirs;
+size_t delta_dirs_cap;
+
+int remember_delta_dir(unsigned int inode_number) {
+    if (num_delta_dirs == delta_dirs_cap) {
+        size_t new_cap = delta_dirs_cap ? delta_dirs_cap * 2 : 64;
+        unsigned int *new_dirs = realloc(delta_dirs, sizeof(unsigned int) * new_cap);
+        if (new_dirs == NULL) {
+            return -ENOMEM;
+        }
+        delta_dirs = new_dirs;
+        delta_dirs_cap = new_cap;
+    }
+    delta_dirs[num_delta_dirs++] = inode_number;
+    return 0;
+}
+
+#define DIR_DELTA_RECORD_SIZE (sizeof(struct wfs_inode) + sizeof(struct wfs_dir_delta))
+
+// Fill in record, DIR_DELTA_RECORD_SIZE bytes, with the addition or removal
+// of one dentry of a directory whose inode and depth have been loaded
+void build_dir_delta(char *record, const struct wfs_inode *parent_inode, unsigned int depth,
+                     const struct wfs_dentry *dentry, int removed) {
+    memset(record, 0, DIR_DELTA_RECORD_SIZE);
+    struct wfs_log_entry *entry = (struct wfs_log_entry *)record;
+    entry->inode = *parent_inode;
+    entry->inode.flags = WFS_ENTRY_DIR_DELTA;
+    entry->inode.size = sizeof(struct wfs_dir_delta);
+    struct wfs_dir_delta *delta = (struct wfs_dir_delta *)entry->data;
+    delta->prev = inode_map_get(parent_inode->inode_number);
+    delta->depth = depth + 1;
+    delta->removed = removed;
+    delta->dir_size = removed ? parent_inode->size - sizeof(struct wfs_dentry) : parent_inode->size + sizeof(struct wfs_dentry);
+    delta->dentry = *dentry;
+}
+
+// Bring the in-memory state of a directory up to date once a record from
+// build_dir_delta() has been appended
+int dir_delta_appended(unsigned int parent_inode_number, const struct wfs_dentry *dentry, int removed, unsigned int depth) {
+    struct dir_index *index = dir_index_find(parent_inode_number);
+    if (index != NULL) {
+        if (removed) {
+            dir_index_remove(index, dentry->name);
+        } else if (dir_index_add(index, dentry->name, dentry->inode_number) != 0) {
+            dir_index_drop(parent_inode_number);
+        }
+    }
+    if (depth == 0) {
+        return remember_delta_dir(parent_inode_number);
+    }
+    return 0;
+}
+
+// Rewrite every directory that has changes on top of its last full entry
+// as one full entry, so chains never outlive a checkpoint
+int fold_directories(void) {
+    for (size_t i = 0; i < num_delta_dirs; i++) {
+        off_t offset = inode_map_get(delta_dirs[i]);
+        struct wfs_inode inode;
+        if (offset == 0) {
+            continue; // Deleted
+        }
+        if (disk_pread(disk_fd, &inode, sizeof(inode), offset) != sizeof(inode)) {
+            return -EIO;
+        }
+        if (inode.flags != WFS_ENTRY_DIR_DELTA) {
+            continue; // Already folded
+        }
+        struct wfs_log_entry *dir_entry = find_last_log_entry(disk_fd, delta_dirs[i]);
+        if (dir_entry == NULL) {
+            return -EIO;
+        }
+        off_t write_offset = append_log_entry(dir_entry, sizeof(struct wfs_inode) + dir_entry->inode.size);
+        free(dir_entry);
+        if (write_offset < 0) {
+            return write_offset;
+        }
+    }
+    num_delta_dirs = 0;
+    return 0;
+}
+
+// Close the current batch with a commit record, so that a mount after a
+// crash will keep it, and optionally wait for it to reach the disk
+int commit_log(int sync) {
+    if (sb.head != batch_start) {
+        char record[COMMIT_RECORD_SIZE] = {0};
+        struct wfs_log_entry *entry = (struct wfs_log_entry *)record;
+        entry->inode.flags = WFS_ENTRY_COMMIT;
+        entry->inode.size = sizeof(struct wfs_commit);
+        struct wfs_commit *commit = (struct wfs_commit *)entry->data;
+        commit->start = batch_start;
+        commit->crc = batch_crc;
+        commit->seq = sb.seq + 1;
+
+        off_t write_offset = append_log_entry(entry, sizeof(record));
+        if (write_offset < 0) {
+            return write_offset;
+        }
+        sb.seq++;
+        batch_start = sb.head;
+        batch_crc = 0;
+    }
+    if (sync && disk_sync() != 0) {
+        perror("Error syncing disk");
+        return -EIO;
+    }
+    return 0;
+}
+
+// Write a superblock if it differs from the one last written
+int write_superblock_copy(const struct wfs_sb *copy) {
+    if (memcmp(&sb_on_disk, copy, sizeof(*copy)) == 0) {
+        return 0;
+    }
+    if (disk_pwrite(disk_fd, copy, WFS_SB_SIZE(copy), 0) != WFS_SB_SIZE(copy)) {
+        perror("Error updating superblock");
+        return -EIO;
+    }
+    sb_on_disk = *copy;
+    return 0;
+}
+
+// Write the superblock if it has changed since it was last written
+int write_superblock(void) {
+    if (sb.head != batch_start) {
+        return -EINVAL; // The head must not point past uncommitted entries
+    }
+    return write_superblock_copy(&sb);
+}
+
+// Whether a header read past the head could be the start of a real entry
+int plausible_entry(const struct wfs_inode *inode, off_t offset) {
+    if (offset + sizeof(struct wfs_inode) + inode->size > disk_size) {
+        return 0;
+    }
+    if (inode->flags == WFS_ENTRY_COMMIT) {
+        return inode->size == sizeof(struct wfs_commit) || inode->size == offsetof(struct wfs_commit, seq);
+    }
+    if (inode->flags == WFS_ENTRY_WRAP) {
+        return offset + sizeof(struct wfs_inode) + inode->size == disk_size;
+    }
+    if (inode->flags == WFS_ENTRY_CHECKPOINT) {
+        return inode->size >= sizeof(struct wfs_checkpoint);
+    }
+    if (inode->flags == WFS_ENTRY_DIR_DELTA) {
+        return inode->size == sizeof(struct wfs_dir_delta) && S_ISDIR(inode->mode);
+    }
+    return inode->flags < WFS_ENTRY_COMMIT && (S_ISREG(inode->mode) || S_ISDIR(inode->mode));
+}
+
+// Roll the head forward over batches committed after the superblock was
+// last written. A batch is kept only if its commit record names the batch's
+// first entry and carries the CRC of every byte up to it, so a torn or
+// stale tail is never taken for new entries. On version 2 images the
+// record must also carry the next sequence number, which tells the batches
+// left behind by the previous pass over a wrapped log from new ones.
+int recover_log(void) {
+    off_t offset = sb.head;
+    off_t start = sb.head;
+    uint32_t crc = 0;
+    uint32_t seq = sb.seq;
+    off_t recovered = 0;
+    int wrapped = 0;
+    off_t checkpoint = 0; // latest checkpoint in the current batch
+    char chunk[64 * 1024];
+    while (1) {
+        if (offset + sizeof(struct wfs_inode) > disk_size) {
+            if (sb.version < 2 || wrapped++) {
+                break;
+            }
+            offset = WFS_SB_SIZE(&sb);
+        }
+        struct wfs_inode inode;
+        if (disk_pread(disk_fd, &inode, sizeof(inode), offset) != sizeof(inode) ||
+            !plausible_entry(&inode, offset)) {
+            break;
+        }
+        if (inode.flags == WFS_ENTRY_COMMIT) {
+            struct wfs_commit commit = {0};
+            if (disk_pread(disk_fd, &commit, inode.size, offset + sizeof(inode)) != inode.size ||
+                commit.start != start || commit.crc != crc ||
+                (sb.version >= 2 && commit.seq != seq + 1)) {
+                break;
+            }
+            offset += sizeof(inode) + inode.size;
+            recovered += offset >= start ? offset - start : disk_size - start + offset - WFS_SB_SIZE(&sb);
+            start = offset;
+            crc = 0;
+            seq = commit.seq;
+            if (checkpoint != 0) {
+                sb.checkpoint = checkpoint;
+                checkpoint = 0;
+            }
+            continue;
+        }
+        if (inode.flags == WFS_ENTRY_CHECKPOINT) {
+            checkpoint = offset;
+        }
+        if (inode.flags == WFS_ENTRY_WRAP) {
+            if (wrapped++) {
+                break;
+            }
+            // Only the header of a wrap entry counts
+            crc = crc32(crc, &inode, sizeof(inode));
+            offset = WFS_SB_SIZE(&sb);
+            continue;
+        }
+
+        size_t remaining = sizeof(inode) + inode.size;
+        while (remaining > 0) {
+            size_t len = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+            if (disk_pread(disk_fd, chunk, len, offset) != len) {
+                break;
+            }
+            crc = crc32(crc, chunk, len);
+            offset += len;
+            remaining -= len;
+        }
+        if (remaining > 0) {
+            break;
+        }
+    }
+
+    if (start != sb.head) {
+        printf("Recovered %ld bytes of committed log entries\n", (long)recovered);
+        sb.head = start;
+        sb.seq = seq;
+        if (disk_pwrite(disk_fd, &sb, WFS_SB_SIZE(&sb), 0) != WFS_SB_SIZE(&sb)) {
+            perror("Error updating superblock");
+            return -EIO;
+        }
+    }
+    batch_start = sb.head;
+    sb_on_disk = sb;
+    return 0;
+}
+
+// Append a checkpoint of the inode map. The superblock points at it once
+// the batch it joins is committed.
+int append_checkpoint(void) {
+    unsigned int num_inodes = 0;
+    for (unsigned int i = 0; i < inode_map_len; i++) {
+        if (inode_map[i] != 0) {
+            num_inodes = i + 1;
+        }
+    }
+    size_t entry_size = sizeof(struct wfs_inode) + sizeof(struct wfs_checkpoint) + sizeof(uint32_t) * num_inodes;
+    struct wfs_log_entry *entry = calloc(1, entry_size);
+    if (entry == NULL) {
+        return -ENOMEM;
+    }
+    entry->inode.flags = WFS_ENTRY_CHECKPOINT;
+    entry->inode.size = entry_size - sizeof(struct wfs_inode);
+    struct wfs_checkpoint *checkpoint = (struct wfs_checkpoint *)entry->data;
+    checkpoint->num_inodes = num_inodes;
+    for (unsigned int i = 0; i < num_inodes; i++) {
+        checkpoint->inode_map[i] = inode_map_get(i);
+    }
+
+    off_t write_offset = append_log_entry(entry, entry_size);
+    free(entry);
+    if (write_offset < 0) {
+        return write_offset;
+    }
+    sb.checkpoint = write_offset;
+    log_since_checkpoint = 0;
+    return 0;
+}
+
+// Load the inode map from the checkpoint the superblock points at.
+// Returns the offset replay should start from, or a negative errno.
+off_t load_checkpoint(void) {
+    if (sb.checkpoint == 0) {
+        return sb.tail;
+    }
+    struct wfs_log_entry *entry = read_log_entry(disk_fd, sb.checkpoint);
+    struct wfs_checkpoint *checkpoint = entry ? (struct wfs_checkpoint *)entry->data : NULL;
+    if (entry == NULL || entry->inode.flags != WFS_ENTRY_CHECKPOINT ||
+        entry->inode.size != sizeof(struct wfs_checkpoint) + sizeof(uint32_t) * checkpoint->num_inodes) {
+        fprintf(stderr, "Invalid checkpoint, replaying the whole log\n");
+        free(entry);
+        sb.checkpoint = 0;
+        return sb.tail;
+    }
+    for (unsigned int i = 0; i < checkpoint->num_inodes; i++) {
+        if (checkpoint->inode_map[i] != 0 && inode_map_set(i, checkpoint->inode_map[i]) != 0) {
+            free(entry);
+            return -ENOMEM;
+        }
+    }
+    off_t replay_start = log_next(sb.checkpoint + sizeof(struct wfs_inode) + entry->inode.size);
+    free(entry);
+    return replay_start;
+}
+
+// The startup scan reads the log sequentially this many bytes at a time
+#define SCAN_CHUNK_SIZE (1 << 20)
+
+// Bring the inode map up to date with the entries from offset to the head.
+// Only headers are needed, so payloads are skipped over without copying,
+// and payloads larger than a chunk are never read at all. A wrapped log is
+// read to the end of the disk and then from its start.
+int replay_log(off_t offset) {
+    char *chunk = malloc(SCAN_CHUNK_SIZE);
+    if (chunk == NULL) {
+        return -ENOMEM;
+    }
+    off_t chunk_start = 0;
+    size_t chunk_len = 0;
+    // Only while the log is scanned, or later reads would be read ahead too
+    posix_fadvise(disk_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (offset != sb.head) {
+        off_t limit = offset < sb.head ? sb.head : disk_size;
+        if (offset < chunk_start || offset + sizeof(struct wfs_inode) > chunk_start + chunk_len) {
+            // Refill from the block the header is in
+            chunk_start = offset - offset % WFS_BLOCK_SIZE;
+            size_t want = limit - chunk_start < SCAN_CHUNK_SIZE ? limit - chunk_start : SCAN_CHUNK_SIZE;
+            chunk_len = 0;
+            while (chunk_len < want) {
+                ssize_t n = disk_pread(disk_fd, chunk + chunk_len, want - chunk_len, chunk_start + chunk_len);
+                if (n <= 0) {
+                    perror("Error reading log");
+                    free(chunk);
+                    return -EIO;
+                }
+                chunk_len += n;
+            }
+            if (offset + sizeof(struct wfs_inode) > chunk_start + chunk_len) {
+                break; // The log ends in the middle of a header
+            }
+        }
+
+        struct wfs_inode inode;
+        memcpy(&inode, chunk + (offset - chunk_start), sizeof(inode));
+        size_t entry_size = sizeof(struct wfs_inode) + inode.size;
+        if (offset + entry_size > limit) {
+            break;
+        }
+        if (is_inode_entry(&inode)) {
+            if (inode_map_set(inode.inode_number, inode.deleted ? 0 : offset) != 0 ||
+                (inode.flags == WFS_ENTRY_DIR_DELTA && remember_delta_dir(inode.inode_number) != 0)) {
+                free(chunk);
+                return -ENOMEM;
+            }
+        }
+        if (inode.flags != WFS_ENTRY_COMMIT && inode.flags != WFS_ENTRY_WRAP) {
+            log_since_checkpoint += entry_size;
+        }
+        offset = log_next(offset + entry_size);
+    }
+    free(chunk);
+    posix_fadvise(disk_fd, 0, 0, POSIX_FADV_NORMAL);
+    return 0;
+}
+
+// Called at the end of every operation. In sync mode the operation's
+// entries are committed, and *gen set for end_operation() to sync once
+// wfs_lock is released, so operations waiting on the disk at the same time
+// share one fdatasync. Otherwise they are left for the commit thread,
+// which also writes the superblock.
+int commit_operation(uint64_t *gen) {
+    *gen = 0;
+    if (config.durability != DURABILITY_SYNC || sb.head == batch_start) {
+        return 0;
+    }
+    int ret = commit_log(0);
+    return ret != 0 ? ret : disk_sync_begin(gen);
+}
+
+// Read the offsets of blocks [first, first + count) of a block-mapped file,
+// which must all lie under the same indirect block
+int read_block_pointers(const struct wfs_bmap *bmap, unsigned int first, unsigned int count, uint32_t *pointers) {
+    unsigned int indirect_index = first / WFS_PTRS_PER_BLOCK;
+    if (indirect_index >= bmap->num_indirect || bmap->indirect[indirect_index] == 0) {
+        memset(pointers, 0, sizeof(uint32_t) * count);
+        return 0;
+    }
+    off_t offset = bmap->indirect[indirect_index] + sizeof(struct wfs_inode) + sizeof(struct wfs_block) +
+                   sizeof(uint32_t) * (first % WFS_PTRS_PER_BLOCK);
+    if (disk_pread(disk_fd, pointers, sizeof(uint32_t) * count, offset) != sizeof(uint32_t) * count) {
+        perror("Error reading indirect block");
+        return -EIO;
+    }
+    return 0;
+}
+
+// Copy [offset, offset + size) of a block-mapped file into buf, reading only
+// the blocks that overlap it. The range must lie within the file.
+int read_block_mapped(const struct wfs_bmap *bmap, char *buf, size_t size, off_t offset) {
+    uint32_t pointers[WFS_PTRS_PER_BLOCK];
+    size_t done = 0;
+    while (done < size) {
+        unsigned int block = (offset + done) / WFS_BLOCK_SIZE;
+        unsigned int last = (offset + size - 1) / WFS_BLOCK_SIZE;
+        unsigned int indirect_end = (block / WFS_PTRS_PER_BLOCK + 1) * WFS_PTRS_PER_BLOCK;
+        unsigned int count = (last < indirect_end ? last + 1 : indirect_end) - block;
+        if (read_block_pointers(bmap, block, count, pointers) != 0) {
+            return -EIO;
+        }
+        for (unsigned int i = 0; i < count; i++) {
+            size_t in_block = (offset + done) % WFS_BLOCK_SIZE;
+            size_t length = WFS_BLOCK_SIZE - in_block;
+            if (length > size - done) {
+                length = size - done;
+            }
+            if (pointers[i] == 0) {
+                memset(buf + done, 0, length);
+            } else {
+                off_t data_offset = pointers[i] + sizeof(struct wfs_inode) + sizeof(struct wfs_block) + in_block;
+                if (disk_pread(disk_fd, buf + done, length, data_offset) != length) {
+                    perror("Error reading data block");
+                    return -EIO;
+                }
+            }
+            done += length;
+        }
+    }
+    return 0;
+}
+
+// Write [offset, offset + size) of a block-mapped file. Appends one block
+// entry per block touched, each indirect block that changed, and a new block
+// map. old_bmap is the file's current map, or NULL if it has none yet.
+int write_block_mapped(const struct wfs_inode *inode, const struct wfs_bmap *old_bmap,
+                       const char *buf, size_t size, off_t offset, size_t new_size) {
+    size_t num_blocks = (new_size + WFS_BLOCK_SIZE - 1) / WFS_BLOCK_SIZE;
+    size_t num_indirect = (num_blocks + WFS_PTRS_PER_BLOCK - 1) / WFS_PTRS_PER_BLOCK;
+    size_t old_num_indirect = old_bmap ? old_bmap->num_indirect : 0;
+    if (num_indirect < old_num_indirect) {
+        num_indirect = old_num_indirect;
+    }
+
+    size_t bmap_entry_size = sizeof(struct wfs_inode) + sizeof(struct wfs_bmap) + sizeof(uint32_t) * num_indirect;
+    struct wfs_log_entry *bmap_entry = malloc(bmap_entry_size);
+    // Indirect blocks are loaded as they are needed and appended at the end
+    struct wfs_log_entry **indirect_entries = calloc(num_indirect, sizeof(struct wfs_log_entry *));
+    size_t block_entry_size = sizeof(struct wfs_inode) + sizeof(struct wfs_block) + WFS_BLOCK_SIZE;
+    struct wfs_log_entry *block_entry = malloc(block_entry_size);
+    int ret = 0;
+    if (!bmap_entry || !indirect_entries || !block_entry) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    struct wfs_bmap *bmap = (struct wfs_bmap *)bmap_entry->data;
+    bmap->file_size = new_size;
+    bmap->num_indirect = num_indirect;
+    memset(bmap->indirect, 0, sizeof(uint32_t) * num_indirect);
+    if (old_bmap) {
+        memcpy(bmap->indirect, old_bmap->indirect, sizeof(uint32_t) * old_num_indirect);
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        unsigned int block = (offset + done) / WFS_BLOCK_SIZE;
+        size_t in_block = (offset + done) % WFS_BLOCK_SIZE;
+        size_t length = WFS_BLOCK_SIZE - in_block;
+        if (length > size - done) {
+            length = size - done;
+        }
+
+        unsigned int indirect_index = block / WFS_PTRS_PER_BLOCK;
+        struct wfs_log_entry *indirect_entry = indirect_entries[indirect_index];
+        if (indirect_entry == NULL) {
+            if (bmap->indirect[indirect_index] != 0) {
+                indirect_entry = read_log_entry(disk_fd, bmap->indirect[indirect_index]);
+                if (indirect_entry == NULL) {
+                    ret = -EIO;
+                    goto out;
+                }
+            } else {
+                indirect_entry = calloc(1, block_entry_size);
+                if (indirect_entry == NULL) {
+                    ret = -ENOMEM;
+                    goto out;
+                }
+                indirect_entry->inode = *inode;
+                indirect_entry->inode.flags = WFS_ENTRY_INDIRECT;
+                indirect_entry->inode.size = sizeof(struct wfs_block) + WFS_BLOCK_SIZE;
+                ((struct wfs_block *)indirect_entry->data)->index = indirect_index;
+            }
+            indirect_entries[indirect_index] = indirect_entry;
+        }
+        uint32_t *pointers = (uint32_t *)((struct wfs_block *)indirect_entry->data)->data;
+        uint32_t *pointer = &pointers[block % WFS_PTRS_PER_BLOCK];
+
+        block_entry->inode = *inode;
+        block_entry->inode.flags = WFS_ENTRY_BLOCK;
+        block_entry->inode.size = sizeof(struct wfs_block) + WFS_BLOCK_SIZE;
+        struct wfs_block *data_block = (struct wfs_block *)block_entry->data;
+        data_block->index = block;
+        if (length < WFS_BLOCK_SIZE) {
+            // Partial block: start from its current contents
+            if (*pointer == 0) {
+                memset(data_block->data, 0, WFS_BLOCK_SIZE);
+            } else if (disk_pread(disk_fd, data_block->data, WFS_BLOCK_SIZE,
+                             *pointer + sizeof(struct wfs_inode) + sizeof(struct wfs_block)) != WFS_BLOCK_SIZE) {
+                perror("Error reading data block");
+                ret = -EIO;
+                goto out;
+            }
+        }
+        memcpy(data_block->data + in_block, buf + done, length);
+
+        off_t block_offset = append_log_entry(block_entry, block_entry_size);
+        if (block_offset < 0) {
+            ret = block_offset;
+            goto out;
+        }
+        *pointer = block_offset;
+        done += length;
+    }
+
+    for (size_t i = 0; i < num_indirect; i++) {
+        if (indirect_entries[i] == NULL) {
+            continue;
+        }
+        off_t indirect_offset = append_log_entry(indirect_entries[i], block_entry_size);
+        if (indirect_offset < 0) {
+            ret = indirect_offset;
+            goto out;
+        }
+        bmap->indirect[i] = indirect_offset;
+    }
+
+    bmap_entry->inode = *inode;
+    bmap_entry->inode.flags = WFS_ENTRY_BMAP;
+    bmap_entry->inode.size = bmap_entry_size - sizeof(struct wfs_inode);
+    off_t bmap_offset = append_log_entry(bmap_entry, bmap_entry_size);
+    if (bmap_offset < 0) {
+        ret = bmap_offset;
+    }
+
+out:
+    if (indirect_entries) {
+        for (size_t i = 0; i < num_indirect; i++) {
+            free(indirect_entries[i]);
+        }
+    }
+    free(indirect_entries);
+    free(block_entry);
+    free(bmap_entry);
+    return ret;
+}
+
+// Change the size of a block-mapped file that stays block-mapped. Blocks
+// past the new end are dropped from the map and the rest of the new last
+// block is zeroed, so that growing the file again later reads zeros there.
+int truncate_block_mapped(const struct wfs_inode *inode, const struct wfs_bmap *old_bmap, size_t new_size) {
+    if (new_size >= old_bmap->file_size) {
+        // Growing only moves the end; the blocks in between are holes
+        return write_block_mapped(inode, old_bmap, NULL, 0, 0, new_size);
+    }
+
+    size_t num_blocks = (new_size + WFS_BLOCK_SIZE - 1) / WFS_BLOCK_SIZE;
+    size_t num_indirect = (num_blocks + WFS_PTRS_PER_BLOCK - 1) / WFS_PTRS_PER_BLOCK;
+    size_t bmap_entry_size = sizeof(struct wfs_inode) + sizeof(struct wfs_bmap) + sizeof(uint32_t) * num_indirect;
+    size_t block_entry_size = sizeof(struct wfs_inode) + sizeof(struct wfs_block) + WFS_BLOCK_SIZE;
+    struct wfs_log_entry *bmap_entry = malloc(bmap_entry_size);
+    struct wfs_log_entry *block_entry = malloc(block_entry_size);
+    struct wfs_log_entry *indirect_entry = NULL;
+    int ret = 0;
+    if (!bmap_entry || !block_entry) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    struct wfs_bmap *bmap = (struct wfs_bmap *)bmap_entry->data;
+    bmap->file_size = new_size;
+    bmap->num_indirect = num_indirect;
+    memcpy(bmap->indirect, old_bmap->indirect, sizeof(uint32_t) * num_indirect);
+
+    // The indirect block holding the new last block keeps only the pointers
+    // up to it, and gets the rewritten last block if that is partial
+    size_t in_block = new_size % WFS_BLOCK_SIZE;
+    size_t last_pointer = (num_blocks - 1) % WFS_PTRS_PER_BLOCK;
+    if (num_blocks != 0 && bmap->indirect[num_indirect - 1] != 0) {
+        indirect_entry = read_log_entry(disk_fd, bmap->indirect[num_indirect - 1]);
+        if (indirect_entry == NULL) {
+            ret = -EIO;
+            goto out;
+        }
+        uint32_t *pointers = (uint32_t *)((struct wfs_block *)indirect_entry->data)->data;
+        if (in_block != 0 && pointers[last_pointer] != 0) {
+            block_entry->inode = *inode;
+            block_entry->inode.flags = WFS_ENTRY_BLOCK;
+            block_entry->inode.size = sizeof(struct wfs_block) + WFS_BLOCK_SIZE;
+            struct wfs_block *data_block = (struct wfs_block *)block_entry->data;
+            data_block->index = num_blocks - 1;
+            if (disk_pread(disk_fd, data_block->data, in_block,
+                      pointers[last_pointer] + sizeof(struct wfs_inode) + sizeof(struct wfs_block)) != in_block) {
+                perror("Error reading data block");
+                ret = -EIO;
+                goto out;
+            }
+            memset(data_block->data + in_block, 0, WFS_BLOCK_SIZE - in_block);
+            off_t block_offset = append_log_entry(block_entry, block_entry_size);
+            if (block_offset < 0) {
+                ret = block_offset;
+                goto out;
+            }
+            pointers[last_pointer] = block_offset;
+        }
+        memset(pointers + last_pointer + 1, 0, sizeof(uint32_t) * (WFS_PTRS_PER_BLOCK - last_pointer - 1));
+        off_t indirect_offset = append_log_entry(indirect_entry, block_entry_size);
+        if (indirect_offset < 0) {
+            ret = indirect_offset;
+            goto out;
+        }
+        bmap->indirect[num_indirect - 1] = indirect_offset;
+    }
+
+    bmap_entry->inode = *inode;
+    bmap_entry->inode.flags = WFS_ENTRY_BMAP;
+    bmap_entry->inode.size = bmap_entry_size - sizeof(struct wfs_inode);
+    off_t bmap_offset = append_log_entry(bmap_entry, bmap_entry_size);
+    if (bmap_offset < 0) {
+        ret = bmap_offset;
+    }
+
+out:
+    free(indirect_entry);
+    free(block_entry);
+    free(bmap_entry);
+    return ret;
+}
+
+
+// Dentry cache: (parent inode, name) -> child inode number, including
+// negative entries for names known to be absent. Entries are only created
+// for parents that are directories, and are replaced or dropped by
+// wfs_mknod/wfs_mkdir/wfs_unlink, so a hit never needs to touch the disk.
+// Least recently used entries are evicted once the memory cap is reached.
+#define DCACHE_NEGATIVE ((unsigned int)-1)
+
+struct dcache_entry {
+    unsigned int parent;
+    unsigned int inode_number;  // DCACHE_NEGATIVE if the name does not exist
+    char name[MAX_FILE_NAME_LEN];
+    struct dcache_entry *hash_next;
+    struct dcache_entry *lru_prev;
+    struct dcache_entry *lru_next;
+};
+
+struct dcache_entry **dcache_buckets;
+size_t dcache_num_buckets;
+size_t dcache_count;
+size_t dcache_max_entries;
+struct dcache_entry dcache_lru = { .lru_prev = &dcache_lru, .lru_next = &dcache_lru };
+
+int dcache_init(size_t max_bytes) {
+    dcache_max_entries = max_bytes / sizeof(struct dcache_entry);
+    dcache_num_buckets = 64;
+    while (dcache_num_buckets < dcache_max_entries) {
+        dcache_num_buckets *= 2;
+    }
+    dcache_buckets = calloc(dcache_num_buckets, sizeof(struct dcache_entry *));
+    if (dcache_buckets == NULL) {
+        perror("Error allocating dentry cache");
+        return -1;
+    }
+    return 0;
+}
+
+size_t dcache_hash(unsigned int parent, const char *name) {
+    // FNV-1a over the parent inode number and the name
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < sizeof(parent); i++) {
+        hash = (hash ^ ((parent >> (8 * i)) & 0xff)) * 1099511628211ULL;
+    }
+    for (const char *c = name; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    return hash & (dcache_num_buckets - 1);
+}
+
+struct dcache_entry **dcache_find_slot(unsigned int parent, const char *name) {
+    struct dcache_entry **slot = &dcache_buckets[dcache_hash(parent, name)];
+    while (*slot != NULL && ((*slot)->parent != parent || strcmp((*slot)->name, name) != 0)) {
+        slot = &(*slot)->hash_next;
+    }
+    return slot;
+}
+
+void dcache_lru_unlink(struct dcache_entry *dentry) {
+    dentry->lru_prev->lru_next = dentry->lru_next;
+    dentry->lru_next->lru_prev = dentry->lru_prev;
+}
+
+void dcache_lru_push(struct dcache_entry *dentry) {
+    dentry->lru_next = dcache_lru.lru_next;
+    dentry->lru_prev = &dcache_lru;
+    dcache_lru.lru_next->lru_prev = dentry;
+    dcache_lru.lru_next = dentry;
+}
+
+// Returns 1 and sets *inode_number on a hit (DCACHE_NEGATIVE for a cached miss)
+int dcache_lookup(unsigned int parent, const char *name, unsigned int *inode_number) {
+    if (dcache_buckets == NULL) {
+        return 0;
+    }
+    struct dcache_entry *dentry = *dcache_find_slot(parent, name);
+    if (dentry == NULL) {
+        return 0;
+    }
+    dcache_lru_unlink(dentry);
+    dcache_lru_push(dentry);
+    *inode_number = dentry->inode_number;
+    return 1;
+}
+
+void dcache_remove(unsigned int parent, const char *name) {
+    if (dcache_buckets == NULL) {
+        return;
+    }
+    struct dcache_entry **slot = dcache_find_slot(parent, name);
+    struct dcache_entry *dentry = *slot;
+    if (dentry == NULL) {
+        return;
+    }
+    *slot = dentry->hash_next;
+    dcache_lru_unlink(dentry);
+    free(dentry);
+    dcache_count--;
+}
+
+void dcache_insert(unsigned int parent, const char *name, unsigned int inode_number) {
+    if (dcache_buckets == NULL || dcache_max_entries == 0 || strlen(name) >= MAX_FILE_NAME_LEN) {
+        return;
+    }
+    struct dcache_entry **slot = dcache_find_slot(parent, name);
+    if (*slot != NULL) {
+        (*slot)->inode_number = inode_number;
+        dcache_lru_unlink(*slot);
+        dcache_lru_push(*slot);
+        return;
+    }
+    if (dcache_count >= dcache_max_entries) {
+        struct dcache_entry *victim = dcache_lru.lru_prev;
+        dcache_remove(victim->parent, victim->name);
+        slot = dcache_find_slot(parent, name);
+    }
+    struct dcache_entry *dentry = malloc(sizeof(struct dcache_entry));
+    if (dentry == NULL) {
+        return; // Caching is best effort
+    }
+    dentry->parent = parent;
+    dentry->inode_number = inode_number;
+    strcpy(dentry->name, name);
+    dentry->hash_next = NULL;
+    *slot = dentry;
+    dcache_lru_push(dentry);
+    dcache_count++;
+}
+
+// Look up one name in a directory, consulting the dentry cache and the
+// directory's index before reading it
+unsigned int lookup_dentry(unsigned int parent_inode_number, const char *name) {
+    unsigned int inode_number;
+    pthread_mutex_lock(&cache_lock);
+    int hit = dcache_lookup(parent_inode_number, name, &inode_number);
+    struct dir_index *index = hit ? NULL : dir_index_find(parent_inode_number);
+    if (index != NULL) {
+        inode_number = dir_index_lookup(index, name);
+        hit = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (hit) {
+        return inode_number;
+    }
+
+    // A directory whose latest entry is full is scanned in place in the
+    // mapping, if there is one, and otherwise read into memory
+    const struct wfs_log_entry *dir_entry = disk_entry(inode_map_get(parent_inode_number));
+    struct wfs_log_entry *entry = NULL;
+    if (dir_entry == NULL || dir_entry->inode.flags != WFS_ENTRY_FULL) {
+        dir_entry = entry = find_last_log_entry(disk_fd, parent_inode_number);
+        if (entry == NULL) {
+            // The entry doesn't exist
+            return -1;
+        }
+    }
+    if (!S_ISDIR(dir_entry->inode.mode)) {
+        free(entry);
+        return -1;
+    }
+
+    const struct wfs_dentry *dentries = (const struct wfs_dentry *)(dir_entry->data);
+    size_t num_dentries = dir_entry->inode.size / sizeof(struct wfs_dentry);
+    pthread_mutex_lock(&cache_lock);
+    // Another lookup may have indexed the directory in the meantime
+    index = dir_index_find(parent_inode_number);
+    if (index == NULL) {
+        index = dir_index_build(parent_inode_number, dentries, num_dentries);
+    }
+    if (index != NULL) {
+        inode_number = dir_index_lookup(index, name);
+        pthread_mutex_unlock(&cache_lock);
+        free(entry);
+        return inode_number;
+    }
+    inode_number = DCACHE_NEGATIVE;
+    for (size_t i = 0; i < num_dentries; i++) {
+        if (strcmp(dentries[i].name, name) == 0) {
+            inode_number = dentries[i].inode_number;
+            break;
+        }
+    }
+    free(entry);
+
+    dcache_insert(parent_inode_number, name, inode_number);
+    pthread_mutex_unlock(&cache_lock);
+    return inode_number;
+}
+
+unsigned int find_inode_number(const char *path) {
+    if (disk_fd == -1) {
+        perror("Error opening filesystem image");
+        return -1;
+    }
+
+    // Walk the path one component at a time without copying it
+    unsigned int current_inode_number = 0;
+    const char *component = path;
+    while (*component != '\0') {
+        if (*component == '/') {
+            component++;
+            continue;
+        }
+        size_t len = strcspn(component, "/");
+        if (len >= MAX_FILE_NAME_LEN) {
+            return -1; // Longer than any name we can store
+        }
+        char name[MAX_FILE_NAME_LEN];
+        memcpy(name, component, len);
+        name[len] = '\0';
+
+        current_inode_number = lookup_dentry(current_inode_number, name);
+        if (current_inode_number == -1) {
+            // The next component of the path was not found in the current directory
+            return -1;
+        }
+        component += len;
+    }
+
+    return current_inode_number; // Return the inode number of the final path component
+}
+
+
+
+// The low-level API numbers inodes from FUSE_ROOT_ID and ours start at the
+// root's 0, so the two always differ by that much
+#define WFS_INODE_NUMBER(ino) ((unsigned int)((ino) - FUSE_ROOT_ID))
+#define WFS_FUSE_INO(inode_number) ((fuse_ino_t)(inode_number) + FUSE_ROOT_ID)
+
+// Fill in the attributes of an inode, open through handle unless that is NULL
+int stat_inode(unsigned int inode_number, struct wfs_handle *handle, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat)); // Clear the stat structure
+
+    struct wfs_inode inode_buf;
+    unsigned int depth;
+
+    //Again, this might be wrong. 
+    if (get_inode(inode_number, handle, &inode_buf, &depth) != 0) {
+        return -ENOENT; // No such file or directory
+    }
+
+    struct wfs_inode *inode = &inode_buf;
+
+    stbuf->st_ino = WFS_FUSE_INO(inode_number);
+    stbuf->st_mode = inode->mode;
+    stbuf->st_nlink = inode->links;
+    stbuf->st_uid = inode->uid;
+    stbuf->st_gid = inode->gid;
+    stbuf->st_size = buffered_size(inode_number, inode->size);
+    stbuf->st_mtime = inode->mtime;
+
+    return 0; // Return 0 on success
+}
+
+/*
 Return file attributes. The "stat" structure is described in detail in the stat(2) manual page.
 For the given pathname, this should fill in the elements of the "stat" structure.
 If a field is meaningless or semi-meaningless (e.g., st_ino) then it should be set to 0 or
@@ -178,526 +2400,2114 @@ given a "reasonable" value. This call is pretty much required for a usable files
 */
 static int wfs_getattr(const char *path, struct stat *stbuf)
 {
-    memset(stbuf, 0, sizeof(struct stat)); // Clear the stat structure
+    unsigned int inode_number = find_inode_number(path);
+
+    //Maybe change this later, since find_inode_number might return -1 for other errors as well. 
+    if (inode_number == -1) {
+        return -ENOENT; // No such file or directory
+    }
+
+    return stat_inode(inode_number, NULL, stbuf);
+}
+
+// What an open directory keeps between readdir calls. The kernel hands
+// every readdir the fh opendir returned, so this lives behind it.
+struct wfs_dir_handle {
+    struct wfs_log_entry *entry; // copy of the listing, NULL until the first readdir
+};
+
+// List a directory from the offset-th entry on, with the attributes of
+// each, until filler says the buffer is full. The offset of an entry is
+// its position in the directory plus one. An open directory keeps a copy
+// of its latest entry in its handle, read again whenever a listing starts
+// over at offset 0, so paging through a large directory reads it only once.
+int list_directory(unsigned int inode_number, struct wfs_dir_handle *dir, off_t offset, void *buf, fuse_fill_dir_t filler) {
+    struct wfs_log_entry *dir_entry = dir ? dir->entry : NULL;
+    if (dir_entry == NULL || offset == 0) {
+        free(dir_entry);
+        if (dir != NULL) {
+            dir->entry = NULL;
+        }
+        dir_entry = find_last_log_entry(disk_fd, inode_number);
+        if (dir_entry == NULL) {
+            return -ENOENT;
+        }
+        if (!S_ISDIR(dir_entry->inode.mode)) {
+            free(dir_entry);
+            return -ENOTDIR;
+        }
+
+        // A listing is often followed by a lookup of every name in it
+        pthread_mutex_lock(&cache_lock);
+        if (dir_index_find(inode_number) == NULL) {
+            dir_index_build(inode_number, (struct wfs_dentry *)dir_entry->data, dir_entry->inode.size / sizeof(struct wfs_dentry));
+        }
+        pthread_mutex_unlock(&cache_lock);
+        if (dir != NULL) {
+            dir->entry = dir_entry;
+        }
+    }
+
+    struct wfs_dentry *dentries = (struct wfs_dentry *)(dir_entry->data);
+    size_t num_dentries = dir_entry->inode.size / sizeof(struct wfs_dentry);
+    for (size_t i = offset; i < num_dentries; i++) {
+        struct stat stbuf;
+        if (stat_inode(dentries[i].inode_number, NULL, &stbuf) != 0) {
+            // Unlinked since the listing started
+            continue;
+        }
+        if (filler(buf, dentries[i].name, &stbuf, i + 1) != 0) {
+            break;
+        }
+    }
+
+    if (dir == NULL) {
+        free(dir_entry);
+    }
+    return 0;
+}
+
+static int wfs_opendir(const char *path, struct fuse_file_info *fi) {
+    unsigned int inode_number = find_inode_number(path);
+    struct wfs_inode inode;
+    unsigned int depth;
+    if (inode_number == -1 || get_inode(inode_number, NULL, &inode, &depth) != 0) {
+        return -ENOENT;
+    }
+    if (!S_ISDIR(inode.mode)) {
+        return -ENOTDIR;
+    }
+    // The listing is read by the first readdir
+    struct wfs_dir_handle *dir = calloc(1, sizeof(struct wfs_dir_handle));
+    if (dir == NULL) {
+        return -ENOMEM;
+    }
+    fi->fh = (uintptr_t)dir;
+    return 0;
+}
+
+static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    // Find the inode number for the given directory path
+    unsigned int dir_inode_number = find_inode_number(path);
+    if (dir_inode_number == -1) {
+        // Directory not found
+        return -ENOENT;
+    }
+
+    struct wfs_dir_handle *dir = fi ? (struct wfs_dir_handle *)(uintptr_t)fi->fh : NULL;
+    return list_directory(dir_inode_number, dir, offset, buf, filler);
+}
+
+// Only frees the handle's copy of the directory, so it needs no lock
+static int wfs_releasedir(const char *path, struct fuse_file_info *fi) {
+    struct wfs_dir_handle *dir = (struct wfs_dir_handle *)(uintptr_t)fi->fh;
+    if (dir != NULL) {
+        free(dir->entry);
+        free(dir);
+    }
+    return 0;
+}
+
+
+// Read part of a file, open through handle unless that is NULL, including
+// writes still buffered for it, and return the number of bytes read
+int read_file(unsigned int file_inode_number, struct wfs_handle *handle, char *buf, size_t size, off_t offset) {
+    struct wfs_inode inode;
+    unsigned int depth;
+    if (get_inode(file_inode_number, handle, &inode, &depth) != 0 || !S_ISREG(inode.mode)) {
+        // Either the entry doesn't exist or it's not a regular file
+        //May not be the correct error
+        return -EISDIR; 
+    }
+
+    // Calculate the amount of data to read, including writes still buffered
+    size_t data_size = buffered_size(file_inode_number, inode.size);
+    size_t read_size = size;
+    if (offset >= data_size) {
+        // Offset is beyond the end of the file
+        return 0;
+    } else if (offset + size > data_size) {
+        // Adjust read_size so as not to read beyond the end of the file
+        read_size = data_size - offset;
+    }
+
+    // Read only the requested range of what is in the log, straight into the buffer
+    size_t logged_size = 0;
+    if (offset < inode.size) {
+        logged_size = inode.size - offset < read_size ? inode.size - offset : read_size;
+    }
+    int ret = 0;
+    if (logged_size != 0 && inode.flags == WFS_ENTRY_BMAP) {
+        struct wfs_log_entry *copy;
+        const struct wfs_log_entry *bmap_entry = get_log_entry(inode_map_get(file_inode_number), &copy);
+        if (bmap_entry == NULL) {
+            return -EIO;
+        }
+        ret = read_block_mapped((const struct wfs_bmap *)bmap_entry->data, buf, logged_size, offset);
+        free(copy);
+    } else if (logged_size != 0) {
+        ret = read_inline_file(file_inode_number, buf, logged_size, offset);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+    memset(buf + logged_size, 0, read_size - logged_size);
+
+    // Overlay data buffered in an open handle
+    struct wfs_handle *dirty_handle = find_dirty_handle(file_inode_number);
+    if (dirty_handle != NULL) {
+        off_t start = dirty_handle->dirty_offset > offset ? dirty_handle->dirty_offset : offset;
+        off_t end = dirty_handle->dirty_offset + dirty_handle->dirty_len;
+        if (end > offset + read_size) {
+            end = offset + read_size;
+        }
+        if (start < end) {
+            memcpy(buf + (start - offset), dirty_handle->dirty + (start - dirty_handle->dirty_offset), end - start);
+        }
+    }
+
+    // Return the number of bytes read
+    return read_size;
+}
+
+// Readahead: once an open file is read sequentially, the blocks of the
+// next window are handed to the kernel with WILLNEED, so they are read from
+// the image in the background while FUSE sends the next requests. The
+// window doubles each time another one is issued, up to READAHEAD_MAX, and
+// a read anywhere else drops it.
+#define READAHEAD_MIN (128 << 10)
+#define READAHEAD_MAX (4 << 20)
+
+// Hint that [offset, offset + size) of the image will be read soon
+void prefetch_image(off_t offset, size_t size) {
+    if (disk_map != NULL) {
+        off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+        madvise(disk_map + start, offset + size - start, MADV_WILLNEED);
+    } else {
+        posix_fadvise(disk_fd, offset, size, POSIX_FADV_WILLNEED);
+    }
+}
+
+// Prefetch [from, to) of a file, coalescing blocks that lie back to back
+void prefetch_file(unsigned int file_inode_number, const struct wfs_inode *inode, off_t from, off_t to) {
+    off_t entry_offset = inode_map_get(file_inode_number);
+    if (inode->flags != WFS_ENTRY_BMAP) {
+        prefetch_image(entry_offset + sizeof(struct wfs_inode) + from, to - from);
+        return;
+    }
+    struct wfs_log_entry *copy;
+    const struct wfs_log_entry *bmap_entry = get_log_entry(entry_offset, &copy);
+    if (bmap_entry == NULL) {
+        return;
+    }
+    const size_t block_entry_size = sizeof(struct wfs_inode) + sizeof(struct wfs_block) + WFS_BLOCK_SIZE;
+    uint32_t pointers[WFS_PTRS_PER_BLOCK];
+    off_t run_start = 0;
+    off_t run_end = 0;
+    unsigned int last = (to - 1) / WFS_BLOCK_SIZE;
+    for (unsigned int block = from / WFS_BLOCK_SIZE; block <= last;) {
+        unsigned int indirect_end = (block / WFS_PTRS_PER_BLOCK + 1) * WFS_PTRS_PER_BLOCK;
+        unsigned int count = (last < indirect_end ? last + 1 : indirect_end) - block;
+        if (read_block_pointers((const struct wfs_bmap *)bmap_entry->data, block, count, pointers) != 0) {
+            break;
+        }
+        for (unsigned int i = 0; i < count; i++) {
+            if (pointers[i] != 0 && pointers[i] == run_end) {
+                run_end += block_entry_size;
+                continue;
+            }
+            if (run_end != run_start) {
+                prefetch_image(run_start, run_end - run_start);
+            }
+            run_start = pointers[i];
+            run_end = pointers[i] != 0 ? pointers[i] + block_entry_size : pointers[i];
+        }
+        block += count;
+    }
+    if (run_end != run_start) {
+        prefetch_image(run_start, run_end - run_start);
+    }
+    free(copy);
+}
+
+// Note a read of [offset, offset + size) through an open handle, and
+// prefetch what comes next if the file is being read sequentially
+void read_ahead(unsigned int file_inode_number, struct wfs_handle *handle, size_t size, off_t offset) {
+    if (handle == NULL || size == 0) {
+        return;
+    }
+    off_t end = offset + size;
+    off_t from = 0;
+    off_t to = 0;
+    pthread_mutex_lock(&cache_lock);
+    // A read going on from the last one makes the file sequential, though
+    // not the first read at the start, which the kernel's readahead covers.
+    // Requests FUSE sends in parallel may arrive a little out of order.
+    int sequential = handle->ra_window != 0 ?
+                     offset >= handle->ra_next - READAHEAD_MIN && offset <= handle->ra_end :
+                     offset == handle->ra_next && offset != 0;
+    if (!sequential) {
+        handle->ra_window = 0;
+        handle->ra_end = 0;
+        handle->ra_next = end;
+    } else {
+        if (handle->ra_next < end) {
+            handle->ra_next = end;
+        }
+        if (handle->ra_window == 0) {
+            handle->ra_window = READAHEAD_MIN;
+            handle->ra_end = end;
+        }
+        // Another window once half of the last one has been read
+        if (handle->ra_next + handle->ra_window / 2 >= handle->ra_end) {
+            from = handle->ra_end > handle->ra_next ? handle->ra_end : handle->ra_next;
+            to = handle->ra_next + handle->ra_window;
+            handle->ra_end = to;
+            if (handle->ra_window < READAHEAD_MAX) {
+                handle->ra_window *= 2;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    struct wfs_inode inode;
+    unsigned int depth;
+    if (from >= to || get_inode(file_inode_number, handle, &inode, &depth) != 0 || depth != 0) {
+        return; // Files with deltas are assembled in memory anyway
+    }
+    if (to > inode.size) {
+        to = inode.size;
+    }
+    if (from < to) {
+        prefetch_file(file_inode_number, &inode, from, to);
+    }
+}
+
+// Data handed to FUSE as a range of disk_fd is only read once wfs_lock is
+// released, so the cleaner could free it and let new entries overwrite it
+// first. The low-level API sends the reply itself and pins the buffer list
+// here until then, and the cleaner waits for pinned reads before it moves
+// the tail past them. The path-based API has libfuse send the reply with
+// no way to tell when it is done, so there such data is read into memory
+// whenever the cleaner runs.
+struct pinned_read {
+    const struct fuse_bufvec *bufv;
+    struct pinned_read *next;
+};
+
+pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pin_cond = PTHREAD_COND_INITIALIZER;
+struct pinned_read *pinned_reads;
+
+// Called under wfs_lock, so the cleaner cannot be between deciding what
+// to free and moving the tail
+void pin_read(struct pinned_read *pin, const struct fuse_bufvec *bufv) {
+    pthread_mutex_lock(&pin_lock);
+    pin->bufv = bufv;
+    pin->next = pinned_reads;
+    pinned_reads = pin;
+    pthread_mutex_unlock(&pin_lock);
+}
+
+void unpin_read(struct pinned_read *pin) {
+    pthread_mutex_lock(&pin_lock);
+    struct pinned_read **link = &pinned_reads;
+    while (*link != pin) {
+        link = &(*link)->next;
+    }
+    *link = pin->next;
+    pthread_cond_broadcast(&pin_cond);
+    pthread_mutex_unlock(&pin_lock);
+}
+
+// Wait until no pinned read points into [start, end) of the disk
+void wait_for_pinned_reads(off_t start, off_t end) {
+    pthread_mutex_lock(&pin_lock);
+    for (;;) {
+        int pinned = 0;
+        for (struct pinned_read *pin = pinned_reads; pin != NULL && !pinned; pin = pin->next) {
+            for (size_t i = 0; i < pin->bufv->count; i++) {
+                const struct fuse_buf *buf = &pin->bufv->buf[i];
+                if ((buf->flags & FUSE_BUF_IS_FD) && buf->pos < end && buf->pos + (off_t)buf->size > start) {
+                    pinned = 1;
+                    break;
+                }
+            }
+        }
+        if (!pinned) {
+            break;
+        }
+        pthread_cond_wait(&pin_cond, &pin_lock);
+    }
+    pthread_mutex_unlock(&pin_lock);
+}
+
+// Free a buffer list the way FUSE frees the ones read_buf returns
+void free_bufvec(struct fuse_bufvec *bufv) {
+    for (size_t i = 0; i < bufv->count; i++) {
+        free(bufv->buf[i].mem);
+    }
+    free(bufv);
+}
+
+// Add length bytes of disk_fd from offset to a buffer list. They are read
+// into memory right away if in_memory is set or they are still queued.
+int add_disk_buf(struct fuse_bufvec *bufv, off_t offset, size_t length, int in_memory) {
+    struct fuse_buf *buf = &bufv->buf[bufv->count++];
+    if (in_memory || write_queued(offset, length)) {
+        buf->mem = malloc(length);
+        if (buf->mem == NULL) {
+            return -ENOMEM;
+        }
+        if (disk_pread(disk_fd, buf->mem, length, offset) != length) {
+            perror("Error reading data block");
+            return -EIO;
+        }
+    } else {
+        buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        buf->fd = disk_fd;
+        buf->pos = offset;
+    }
+    buf->size = length;
+    return 0;
+}
+
+// Add length zero bytes to a buffer list
+int add_zero_buf(struct fuse_bufvec *bufv, size_t length) {
+    struct fuse_buf *buf = &bufv->buf[bufv->count++];
+    buf->mem = calloc(1, length);
+    if (buf->mem == NULL) {
+        return -ENOMEM;
+    }
+    buf->size = length;
+    return 0;
+}
+
+// Like read_file, but describe the data as a list of buffers in *bufp for
+// FUSE to splice to the kernel, pointing at the disk image wherever the
+// data is stored there as is. Files with deltas to apply and ranges with
+// buffered writes are put together in memory instead. Unless the caller
+// pins the list with pin_read() until the reply is sent, ranges of the
+// image are only handed out while the cleaner is off.
+int read_file_buf(unsigned int file_inode_number, struct wfs_handle *handle, size_t size, off_t offset, int pinned,
+                  struct fuse_bufvec **bufp) {
+    struct wfs_inode inode;
+    unsigned int depth;
+    if (get_inode(file_inode_number, handle, &inode, &depth) != 0 || !S_ISREG(inode.mode)) {
+        return -EISDIR;
+    }
+
+    size_t data_size = buffered_size(file_inode_number, inode.size);
+    size_t read_size = 0;
+    if (offset < data_size) {
+        read_size = offset + size > data_size ? data_size - offset : size;
+    }
+    size_t logged_size = 0;
+    if (offset < inode.size) {
+        logged_size = inode.size - offset < read_size ? inode.size - offset : read_size;
+    }
+
+    struct wfs_handle *dirty_handle = find_dirty_handle(file_inode_number);
+    int assemble = depth != 0;
+    int in_memory = (bcache_pages != NULL && disk_map == NULL && read_size <= BCACHE_SMALL_READ) ||
+                    (cleaner_enabled && !pinned);
+    if (dirty_handle != NULL && read_size != 0) {
+        assemble |= dirty_handle->dirty_offset < offset + read_size &&
+                    dirty_handle->dirty_offset + dirty_handle->dirty_len > offset;
+    }
+
+    // One buffer per block at most, and one for the zeros past the log
+    size_t max_bufs = 2;
+    if (!assemble && logged_size != 0 && inode.flags == WFS_ENTRY_BMAP) {
+        max_bufs += (offset + logged_size - 1) / WFS_BLOCK_SIZE - offset / WFS_BLOCK_SIZE + 1;
+    }
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * max_bufs);
+    if (bufv == NULL) {
+        return -ENOMEM;
+    }
+    memset(bufv, 0, sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * max_bufs);
+
+    int ret = 0;
+    if (read_size == 0) {
+        // Nothing to read at or past the end of the file
+    } else if (assemble) {
+        struct fuse_buf *buf = &bufv->buf[bufv->count++];
+        buf->mem = malloc(read_size);
+        if (buf->mem == NULL) {
+            ret = -ENOMEM;
+        } else {
+            ret = read_file(file_inode_number, handle, buf->mem, read_size, offset);
+            buf->size = read_size;
+        }
+    } else if (logged_size != 0 && inode.flags == WFS_ENTRY_BMAP) {
+        struct wfs_log_entry *copy;
+        const struct wfs_log_entry *bmap_entry = get_log_entry(inode_map_get(file_inode_number), &copy);
+        if (bmap_entry == NULL) {
+            ret = -EIO;
+        }
+        uint32_t pointers[WFS_PTRS_PER_BLOCK];
+        size_t done = 0;
+        while (ret >= 0 && done < logged_size) {
+            unsigned int block = (offset + done) / WFS_BLOCK_SIZE;
+            unsigned int last = (offset + logged_size - 1) / WFS_BLOCK_SIZE;
+            unsigned int indirect_end = (block / WFS_PTRS_PER_BLOCK + 1) * WFS_PTRS_PER_BLOCK;
+            unsigned int count = (last < indirect_end ? last + 1 : indirect_end) - block;
+            ret = read_block_pointers((const struct wfs_bmap *)bmap_entry->data, block, count, pointers);
+            for (unsigned int i = 0; ret >= 0 && i < count; i++) {
+                size_t in_block = (offset + done) % WFS_BLOCK_SIZE;
+                size_t length = WFS_BLOCK_SIZE - in_block;
+                if (length > logged_size - done) {
+                    length = logged_size - done;
+                }
+                if (pointers[i] == 0) {
+                    ret = add_zero_buf(bufv, length);
+                } else {
+                    ret = add_disk_buf(bufv, pointers[i] + sizeof(struct wfs_inode) + sizeof(struct wfs_block) + in_block, length, in_memory);
+                }
+                done += length;
+            }
+        }
+        free(copy);
+    } else if (logged_size != 0) {
+        // A file without deltas is stored whole in its latest entry
+        ret = add_disk_buf(bufv, inode_map_get(file_inode_number) + sizeof(struct wfs_inode) + offset, logged_size, in_memory);
+    }
+    if (ret >= 0 && !assemble && read_size > logged_size) {
+        ret = add_zero_buf(bufv, read_size - logged_size);
+    }
+    if (ret < 0) {
+        free_bufvec(bufv);
+        return ret;
+    }
+
+    if (bufv->count == 0) {
+        bufv->count = 1;
+    }
+    *bufp = bufv;
+    read_ahead(file_inode_number, handle, read_size, offset);
+    return 0;
+}
+
+static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    // An open file is read through its handle without looking it up again
+    struct wfs_handle *handle = fi ? (struct wfs_handle *)(uintptr_t)fi->fh : NULL;
+    unsigned int file_inode_number;
+    if (handle != NULL) {
+        file_inode_number = handle->inode_number;
+    } else {
+        // Find the inode number for the given file path
+        file_inode_number = find_inode_number(path);
+    }
+    if (file_inode_number == -1) {
+        // File not found
+        return -ENOENT;
+    }
+
+    int ret = read_file(file_inode_number, handle, buf, size, offset);
+    if (ret > 0) {
+        read_ahead(file_inode_number, handle, ret, offset);
+    }
+    return ret;
+}
+
+static int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = fi ? (struct wfs_handle *)(uintptr_t)fi->fh : NULL;
+    unsigned int file_inode_number = handle != NULL ? handle->inode_number : find_inode_number(path);
+    if (file_inode_number == -1) {
+        // File not found
+        return -ENOENT;
+    }
+
+    return read_file_buf(file_inode_number, handle, size, offset, 0, bufp);
+}
+
+
+// Create an empty file or directory of the given mode in a directory, and
+// return its inode number in *inode_number unless that is NULL
+int make_node(unsigned int parent_inode_number, const char *name, mode_t mode, unsigned int *inode_number) {
+    if (strlen(name) >= MAX_FILE_NAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+
+    // The parent must be a directory
+    struct wfs_inode parent_inode;
+    unsigned int parent_depth;
+    if (load_inode(parent_inode_number, &parent_inode, &parent_depth) != 0 || !S_ISDIR(parent_inode.mode)) {
+        return -ENOTDIR; // Parent is not a directory
+    }
+
+    // Check if the file already exists
+    if (lookup_dentry(parent_inode_number, name) != -1) {
+        return -EEXIST; // File exists
+    }
+
+    // Take a free inode number
+    unsigned int new_inode_number = inode_alloc();
+    if (new_inode_number == -1) {
+        return -ENOSPC;
+    }
+    struct wfs_dentry new_dentry = { .inode_number = new_inode_number };
+    strcpy(new_dentry.name, name);
+    // Create the new inode
+    struct wfs_inode new_inode = {
+        .inode_number = new_inode_number,
+        .mode = mode,
+        .uid = getuid(),
+        .gid = getgid(),
+        .size = 0,
+        .links = 1,
+        .deleted = 0
+    };
+
+    // Create a new log entry for the file
+    struct wfs_log_entry new_file_entry = {
+        .inode = new_inode
+        // .data field is not needed as it's a file with no content yet
+    };
+
+    // Add the dentry to the parent, without rewriting the rest of it
+    char parent_record[DIR_DELTA_RECORD_SIZE];
+    build_dir_delta(parent_record, &parent_inode, parent_depth, &new_dentry, 0);
+
+    // Both go out together, so a crash never keeps one without the other
+    const struct wfs_log_entry *entries[] = { &new_file_entry, (struct wfs_log_entry *)parent_record };
+    const size_t sizes[] = { sizeof(new_file_entry), sizeof(parent_record) };
+    off_t write_offset = append_log_entries(entries, sizes, 2);
+    if (write_offset < 0) {
+        inode_release(new_inode_number);
+        printf("Error in pwrite, child\n");
+        return write_offset;
+    }
+
+    int ret = dir_delta_appended(parent_inode_number, &new_dentry, 0, parent_depth);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // The name now resolves to the new inode
+    dcache_insert(parent_inode_number, new_dentry.name, new_inode_number);
+
+    if (inode_number != NULL) {
+        *inode_number = new_inode_number;
+    }
+    return 0; // Success
+}
+
+// Create the last component of a path in the directory named by the rest
+static int make_path(const char *path, mode_t mode, unsigned int *inode_number) {
+    // Extract the parent directory's path and name of the new file
+    char *path_copy_dir = strdup(path); // Make a copy for dirname
+    char *path_copy_base = strdup(path); // Make a copy for basename
+    if (!path_copy_dir || !path_copy_base) {
+        // Handle memory allocation failure
+        free(path_copy_dir);
+        free(path_copy_base);
+        return -ENOMEM;
+    }
+    // Find inode number for the parent directory
+    unsigned int parent_inode_number = find_inode_number(dirname(path_copy_dir));
+    int ret = -ENOENT; // Parent directory doesn't exist
+    if (parent_inode_number != -1) {
+        ret = make_node(parent_inode_number, basename(path_copy_base), mode, inode_number);
+    }
+
+    // Clean up
+    free(path_copy_dir);
+    free(path_copy_base);
+    return ret;
+}
+
+static int wfs_mkdir(const char *path, mode_t mode) {
+    return make_path(path, S_IFDIR | mode, NULL);
+}
+
+static int wfs_mknod(const char *path, mode_t mode, dev_t rdev) {
+    return make_path(path, S_IFREG | mode, NULL); // Regular file with the specified mode
+}
+
+// Remove a name from a directory and mark the inode it names deleted
+int remove_node(unsigned int parent_inode_number, const char *name) {
+    if (strlen(name) >= MAX_FILE_NAME_LEN) {
+        return -ENOENT;
+    }
+
+    // Find the inode number for the file
+    unsigned int inode_number = lookup_dentry(parent_inode_number, name);
+    if (inode_number == -1) {
+        // File not found
+        return -ENOENT;
+    }
+
+    // Get the current inode of the file
+    struct wfs_log_entry *file_entry = malloc(sizeof(struct wfs_log_entry));
+    if (file_entry == NULL) {
+        return -ENOMEM;
+    }
+    unsigned int depth;
+    if (load_inode(inode_number, &file_entry->inode, &depth) != 0) {
+        free(file_entry);
+        return -EIO; // Input/output error
+    }
+
+    struct wfs_dentry removed_dentry = { .inode_number = inode_number };
+    strcpy(removed_dentry.name, name);
+
+    // Data still buffered for the file is dropped with it
+    for (struct wfs_handle *handle = open_handles; handle != NULL; handle = handle->next) {
+        if (handle->inode_number == inode_number) {
+            handle->dirty_len = 0;
+        }
+    }
+
+    // Mark the inode as deleted; the marker carries no data
+    file_entry->inode.deleted = 1;
+    file_entry->inode.flags = WFS_ENTRY_FULL;
+    file_entry->inode.size = 0;
+
+    // Remove the dentry from the parent
+    struct wfs_inode parent_inode;
+    unsigned int parent_depth;
+    if (load_inode(parent_inode_number, &parent_inode, &parent_depth) != 0) {
+        free(file_entry);
+        return -EIO;
+    }
+    if (!S_ISDIR(parent_inode.mode)) {
+        free(file_entry);
+        return -ENOTDIR;
+    }
+    char parent_record[DIR_DELTA_RECORD_SIZE];
+    build_dir_delta(parent_record, &parent_inode, parent_depth, &removed_dentry, 1);
+
+    // Append the updated log entry and the parent's change together
+    const struct wfs_log_entry *entries[] = { file_entry, (struct wfs_log_entry *)parent_record };
+    const size_t sizes[] = { sizeof(struct wfs_inode), sizeof(parent_record) };
+    off_t write_offset = append_log_entries(entries, sizes, 2);
+    if (write_offset < 0) {
+        free(file_entry);
+        return write_offset;
+    }
+
+    // The number can be reused once nothing refers to it
+    if (!inode_referenced(inode_number)) {
+        inode_release(inode_number);
+    }
+
+    int ret = dir_delta_appended(parent_inode_number, &removed_dentry, 1, parent_depth);
+    if (ret != 0) {
+        free(file_entry);
+        return ret;
+    }
+
+    // The name is now known not to exist
+    dcache_insert(parent_inode_number, removed_dentry.name, DCACHE_NEGATIVE);
+
+    free(file_entry);
+    return 0; // Success
+}
+
+static int wfs_unlink(const char *path) {
+    // Find the parent directory so the name can be removed from it
+    char *path_copy_dir = strdup(path);
+    char *path_copy_base = strdup(path);
+    if (path_copy_dir == NULL || path_copy_base == NULL) {
+        free(path_copy_dir);
+        free(path_copy_base);
+        return -ENOMEM;
+    }
+    unsigned int parent_inode_number = find_inode_number(dirname(path_copy_dir));
+    int ret = -ENOENT;
+    if (parent_inode_number != -1) {
+        ret = remove_node(parent_inode_number, basename(path_copy_base));
+    }
+    free(path_copy_dir);
+    free(path_copy_base);
+    return ret;
+}
+
+
+// Write to a file stored inline, as a delta unless the chain is due to be
+// folded or the write replaces the whole file
+int write_inline_file(unsigned int inode_number, const struct wfs_inode *inode, unsigned int depth,
+                      const char *buf, size_t size, off_t offset, size_t new_size) {
+    struct wfs_log_entry *updated_entry;
+    size_t new_entry_size;
+    if (offset == 0 && size >= inode->size) {
+        // The write replaces the whole file, so append it as a full entry
+        new_entry_size = sizeof(struct wfs_log_entry) + new_size;
+        updated_entry = (struct wfs_log_entry *)malloc(new_entry_size);
+        if (!updated_entry) {
+            return -ENOMEM; // Not enough memory
+        }
+        updated_entry->inode = *inode;
+        updated_entry->inode.size = new_size;
+        memcpy(updated_entry->data, buf, size);
+    } else if (depth + 1 >= MAX_DELTA_DEPTH) {
+        // Fold the delta chain back into a full entry
+        struct wfs_log_entry *file_entry = find_last_log_entry(disk_fd, inode_number);
+        if (file_entry == NULL) {
+            return -EIO; // Input/output error
+        }
+        new_entry_size = sizeof(struct wfs_log_entry) + new_size;
+        updated_entry = (struct wfs_log_entry *)malloc(new_entry_size);
+        if (!updated_entry) {
+            free(file_entry);
+            return -ENOMEM; // Not enough memory
+        }
+        updated_entry->inode = *inode;
+        updated_entry->inode.size = new_size;
+
+        // Copy existing data, zero any hole and apply the new data
+        memcpy(updated_entry->data, file_entry->data, file_entry->inode.size);
+        memset(updated_entry->data + file_entry->inode.size, 0, new_size - file_entry->inode.size);
+        memcpy(updated_entry->data + offset, buf, size);
+        free(file_entry);
+    } else {
+        // Append only the written range
+        new_entry_size = sizeof(struct wfs_log_entry) + sizeof(struct wfs_delta) + size;
+        updated_entry = (struct wfs_log_entry *)malloc(new_entry_size);
+        if (!updated_entry) {
+            return -ENOMEM; // Not enough memory
+        }
+        updated_entry->inode = *inode;
+        updated_entry->inode.flags = WFS_ENTRY_DELTA;
+        updated_entry->inode.size = sizeof(struct wfs_delta) + size;
+
+        struct wfs_delta *delta = (struct wfs_delta *)updated_entry->data;
+        delta->prev = inode_map_get(inode_number);
+        delta->depth = depth + 1;
+        delta->offset = offset;
+        delta->length = size;
+        delta->file_size = new_size;
+        memcpy(delta + 1, buf, size);
+    }
+
+    // Append the new file log entry to the log
+    off_t write_offset = append_log_entry(updated_entry, new_entry_size);
+    free(updated_entry);
+    if (write_offset < 0) {
+        return write_offset;
+    }
+    return 0;
+}
+
+// Write to a file that is, or is about to become, block-mapped
+int write_large_file(unsigned int inode_number, const struct wfs_inode *inode,
+                     const char *buf, size_t size, off_t offset, size_t new_size) {
+    int ret;
+    if (inode->flags == WFS_ENTRY_BMAP) {
+        struct wfs_log_entry *bmap_entry = read_log_entry(disk_fd, inode_map_get(inode_number));
+        if (bmap_entry == NULL) {
+            return -EIO;
+        }
+        ret = write_block_mapped(inode, (struct wfs_bmap *)bmap_entry->data, buf, size, offset, new_size);
+        free(bmap_entry);
+        return ret;
+    }
+
+    // Move the inline contents out to blocks together with this write
+    struct wfs_log_entry *file_entry = find_last_log_entry(disk_fd, inode_number);
+    if (file_entry == NULL) {
+        return -EIO;
+    }
+    char *contents = calloc(1, new_size);
+    if (contents == NULL) {
+        free(file_entry);
+        return -ENOMEM;
+    }
+    memcpy(contents, file_entry->data, file_entry->inode.size);
+    memcpy(contents + offset, buf, size);
+    free(file_entry);
 
-    unsigned int inode_number = find_inode_number(path);
+    ret = write_block_mapped(inode, NULL, contents, new_size, 0, new_size);
+    free(contents);
+    return ret;
+}
 
-    //Maybe change this later, since find_inode_number might return -1 for other errors as well. 
-    if (inode_number == -1) {
-        return -ENOENT; // No such file or directory
+// Apply one write to a file, open through handle unless that is NULL, and
+// append it to the log
+int write_file(unsigned int inode_number, struct wfs_handle *handle, const char *buf, size_t size, off_t offset) {
+    // Get the current inode of the file
+    struct wfs_inode inode;
+    unsigned int depth;
+    if (get_inode(inode_number, handle, &inode, &depth) != 0) {
+        return -EIO; // Input/output error
+    }
+    if (!S_ISREG(inode.mode)) {
+        return -EISDIR;
     }
 
-    struct wfs_log_entry *entry = find_last_log_entry(disk_fd, inode_number);
+    if (offset + size > UINT32_MAX) {
+        return -EFBIG; // Sizes are stored in 32 bits
+    }
 
-    //Again, this might be wrong. 
+    // Check if offset + size exceeds the current file size
+    size_t new_size = offset + size > inode.size ? offset + size : inode.size;
+
+    int ret;
+    if (inode.flags == WFS_ENTRY_BMAP || new_size > MAX_INLINE_SIZE) {
+        ret = write_large_file(inode_number, &inode, buf, size, offset, new_size);
+    } else {
+        ret = write_inline_file(inode_number, &inode, depth, buf, size, offset, new_size);
+    }
+    return ret;
+}
+
+// Commit the data buffered in a handle as a single write
+int handle_flush(struct wfs_handle *handle) {
+    if (handle->dirty_len == 0) {
+        return 0;
+    }
+    int ret = write_file(handle->inode_number, handle, handle->dirty, handle->dirty_len, handle->dirty_offset);
+    handle->dirty_len = 0;
+    return ret;
+}
+
+// Commit whatever another handle has buffered for an inode, so that at most
+// one handle holds dirty data for it and writes reach the log in order
+int flush_inode(unsigned int inode_number, struct wfs_handle *except) {
+    struct wfs_handle *handle = find_dirty_handle(inode_number);
+    if (handle == NULL || handle == except) {
+        return 0;
+    }
+    return handle_flush(handle);
+}
+
+// Set the size of a file. Shrinking a file, or growing it by more than a
+// write would, is not something a delta can record, so the file is
+// rewritten inline or gets a new block map.
+int truncate_file(unsigned int inode_number, struct wfs_handle *handle, off_t size) {
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if (size > UINT32_MAX) {
+        return -EFBIG; // Sizes are stored in 32 bits
+    }
+    // Buffered data must reach the log first so it is cut off with the rest
+    int ret = flush_inode(inode_number, NULL);
+    if (ret != 0) {
+        return ret;
+    }
+
+    struct wfs_inode inode;
+    unsigned int depth;
+    if (get_inode(inode_number, handle, &inode, &depth) != 0) {
+        return -ENOENT;
+    }
+    if (!S_ISREG(inode.mode)) {
+        return -EISDIR;
+    }
+    if (size == inode.size) {
+        return 0;
+    }
+
+    if (size > MAX_INLINE_SIZE && inode.flags == WFS_ENTRY_BMAP) {
+        struct wfs_log_entry *bmap_entry = read_log_entry(disk_fd, inode_map_get(inode_number));
+        if (bmap_entry == NULL) {
+            return -EIO;
+        }
+        ret = truncate_block_mapped(&inode, (struct wfs_bmap *)bmap_entry->data, size);
+        free(bmap_entry);
+        return ret;
+    }
+    if (size > MAX_INLINE_SIZE) {
+        return write_large_file(inode_number, &inode, NULL, 0, 0, size);
+    }
+
+    // The file fits inline at its new size, so append it as a full entry
+    size_t entry_size = sizeof(struct wfs_log_entry) + size;
+    struct wfs_log_entry *entry = malloc(entry_size);
     if (entry == NULL) {
-        return -ENOENT; // No such file or directory
+        return -ENOMEM;
+    }
+    ret = read_file(inode_number, handle, entry->data, size, 0);
+    if (ret < 0) {
+        free(entry);
+        return ret;
     }
+    memset(entry->data + ret, 0, size - ret);
+    entry->inode = inode;
+    entry->inode.flags = WFS_ENTRY_FULL;
+    entry->inode.size = size;
+    off_t write_offset = append_log_entry(entry, entry_size);
+    free(entry);
+    return write_offset < 0 ? write_offset : 0;
+}
 
-    struct wfs_inode *inode = &(entry->inode);
-    // //Print path and inode number
-    // printf("path: %s\n", path);
+// Open an inode and keep the new handle in fi->fh
+int open_handle(unsigned int inode_number, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = calloc(1, sizeof(struct wfs_handle));
+    if (handle == NULL) {
+        return -ENOMEM;
+    }
+    handle->inode_number = inode_number;
+    pthread_mutex_lock(&handles_lock);
+    handle->next = open_handles;
+    open_handles = handle;
+    pthread_mutex_unlock(&handles_lock);
+    fi->fh = (uintptr_t)handle;
+    // Every change to the image goes through this mount, and so through
+    // the kernel, so pages it cached earlier are never stale
+    fi->keep_cache = config.kernel_cache;
+    return 0;
+}
 
-    stbuf->st_mode = inode->mode;
-    stbuf->st_nlink = inode->links;
-    stbuf->st_uid = inode->uid;
-    stbuf->st_gid = inode->gid;
-    stbuf->st_size = inode->size;
-    stbuf->st_mtime = inode->mtime;
+static int wfs_open(const char *path, struct fuse_file_info *fi) {
+    unsigned int inode_number = find_inode_number(path);
+    if (inode_number == -1) {
+        return -ENOENT;
+    }
+    return open_handle(inode_number, fi);
+}
 
-    return 0; // Return 0 on success
+static int wfs_flush(const char *path, struct fuse_file_info *fi) {
+    return handle_flush((struct wfs_handle *)(uintptr_t)fi->fh);
 }
 
-static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    // (void) offset; // Unused parameter
-    // (void) fi;     // Unused parameter
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    int ret = handle_flush((struct wfs_handle *)(uintptr_t)fi->fh);
+    if (ret != 0) {
+        return ret;
+    }
+    // Commit whatever the durability mode; locked_fsync() then syncs
+    return commit_log(0);
+}
 
-    // Find the inode number for the given directory path
-    unsigned int dir_inode_number = find_inode_number(path);
-    if (dir_inode_number == -1) {
-        // Directory not found
+static int wfs_release(const char *path, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = (struct wfs_handle *)(uintptr_t)fi->fh;
+    int ret = handle_flush(handle);
+    unlink_handle(handle);
+    // The last handle of an unlinked file gives its number back
+    if (inode_map_get(handle->inode_number) == 0 && !inode_referenced(handle->inode_number)) {
+        inode_release(handle->inode_number);
+    }
+    free(handle->dirty);
+    free(handle);
+    return ret;
+}
+
+// Return the data of a buffer list in one piece of memory, copying it into
+// *copy, which the caller frees, unless it already is
+const char *bufvec_memory(struct fuse_bufvec *src, char **copy) {
+    *copy = NULL;
+    if (src->count == 1 && !(src->buf[0].flags & FUSE_BUF_IS_FD)) {
+        return (const char *)src->buf[0].mem + src->off;
+    }
+    size_t size = fuse_buf_size(src);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = *copy = malloc(size ? size : 1);
+    if (*copy == NULL || fuse_buf_copy(&dst, src, 0) != size) {
+        free(*copy);
+        return NULL;
+    }
+    return *copy;
+}
+
+// Write to a file, buffering the data in handle if there is one, and
+// return the number of bytes written. The data may still be in the pipe
+// the kernel handed it over in, and is then read straight into the buffer.
+int buffered_write(unsigned int inode_number, struct wfs_handle *handle, struct fuse_bufvec *src, off_t offset) {
+    size_t size = fuse_buf_size(src);
+    if (inode_map_get(inode_number) == 0) {
+        // File not found
         return -ENOENT;
     }
+    if (offset + size > UINT32_MAX) {
+        return -EFBIG; // Buffered data must fit once it reaches the log
+    }
 
-    // Get the latest log entry for this directory inode
-    struct wfs_log_entry *dir_entry = find_last_log_entry(disk_fd, dir_inode_number);
-    if (dir_entry == NULL || !S_ISDIR(dir_entry->inode.mode)) {
-        // Either the entry doesn't exist or it's not a directory
-        //May not be the correct error
-        return -ENOTDIR;
+    int ret = flush_inode(inode_number, handle);
+    if (ret != 0) {
+        return ret;
     }
 
-    // Iterate over the directory entries stored in the log entry's data
-    struct wfs_dentry *dentries = (struct wfs_dentry *)(dir_entry->data);
-    size_t num_dentries = dir_entry->inode.size / sizeof(struct wfs_dentry);
-    for (size_t i = 0; i < num_dentries; ++i) {
-        // Call filler function to fill the buffer with directory entries
-        // The filler function returns 1 when the buffer is full, 0 otherwise
-        if (filler(buf, dentries[i].name, NULL, 0) != 0) {
-            // Buffer is full, stop reading
-            free(dir_entry);
-            return 0;
+    // Writes that cannot be buffered go straight to the log
+    if (handle == NULL || size >= config.writeback_size) {
+        if (handle != NULL && (ret = handle_flush(handle)) != 0) {
+            return ret;
         }
+        char *copy;
+        const char *buf = bufvec_memory(src, &copy);
+        if (buf == NULL) {
+            return -EIO;
+        }
+        ret = write_file(inode_number, handle, buf, size, offset);
+        free(copy);
+        return ret == 0 ? size : ret;
     }
 
-    // Clean up
-    free(dir_entry);
-    return 0;
-}
+    // The buffer holds one contiguous range, so commit it before starting
+    // a new one elsewhere in the file
+    off_t dirty_end = handle->dirty_offset + handle->dirty_len;
+    if (handle->dirty_len != 0 && (offset > dirty_end || offset + size < handle->dirty_offset)) {
+        if ((ret = handle_flush(handle)) != 0) {
+            return ret;
+        }
+    }
+
+    off_t start = offset;
+    off_t end = offset + size;
+    if (handle->dirty_len != 0) {
+        start = handle->dirty_offset < start ? handle->dirty_offset : start;
+        end = dirty_end > end ? dirty_end : end;
+    }
+    if (end - start > handle->dirty_cap) {
+        size_t new_cap = handle->dirty_cap ? handle->dirty_cap : WFS_BLOCK_SIZE;
+        while (new_cap < end - start) {
+            new_cap *= 2;
+        }
+        char *new_dirty = realloc(handle->dirty, new_cap);
+        if (new_dirty == NULL) {
+            return -ENOMEM;
+        }
+        handle->dirty = new_dirty;
+        handle->dirty_cap = new_cap;
+    }
+    if (handle->dirty_len != 0 && start < handle->dirty_offset) {
+        // What is buffered moves up, so the new data must be at hand first
+        char *copy;
+        const char *buf = bufvec_memory(src, &copy);
+        if (buf == NULL) {
+            return -EIO;
+        }
+        memmove(handle->dirty + (handle->dirty_offset - start), handle->dirty, handle->dirty_len);
+        memcpy(handle->dirty + (offset - start), buf, size);
+        free(copy);
+    } else {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = handle->dirty + (offset - start);
+        ssize_t copied = fuse_buf_copy(&dst, src, 0);
+        if (copied < 0) {
+            return copied;
+        }
+        // Only what arrived counts as written
+        size = copied;
+        end = offset + size;
+        if (handle->dirty_len != 0 && dirty_end > end) {
+            end = dirty_end;
+        }
+    }
+    handle->dirty_offset = start;
+    handle->dirty_len = end - start;
 
+    if (handle->dirty_len >= config.writeback_size && (ret = handle_flush(handle)) != 0) {
+        return ret;
+    }
 
-static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    // (void) fi; // Unused parameter
+    // Return the number of bytes written
+    return size;
+}
 
-    // Find the inode number for the given file path
-    unsigned int file_inode_number = find_inode_number(path);
-    if (file_inode_number == -1) {
+static int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = fi ? (struct wfs_handle *)(uintptr_t)fi->fh : NULL;
+    unsigned int inode_number;
+    if (handle != NULL) {
+        inode_number = handle->inode_number;
+    } else {
+        // Find the inode number for the file
+        inode_number = find_inode_number(path);
+    }
+    if (inode_number == -1) {
         // File not found
         return -ENOENT;
     }
+    return buffered_write(inode_number, handle, buf, offset);
+}
 
-    // Get the latest log entry for this file inode
-    struct wfs_log_entry *file_entry = find_last_log_entry(disk_fd, file_inode_number);
-    if (file_entry == NULL || !S_ISREG(file_entry->inode.mode)) {
-        // Either the entry doesn't exist or it's not a regular file
-        //May not be the correct error
-        return -EISDIR; 
+static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].mem = (void *)buf;
+    return wfs_write_buf(path, &src, offset, fi);
+}
+
+// Create and open a file in one go, so the file is only looked up once
+static int wfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    unsigned int inode_number;
+    int ret = make_path(path, S_IFREG | mode, &inode_number);
+    if (ret != 0) {
+        return ret;
     }
+    return open_handle(inode_number, fi);
+}
 
-    // Calculate the amount of data to read
-    size_t data_size = file_entry->inode.size;
-    size_t read_size = size;
-    if (offset >= data_size) {
-        // Offset is beyond the end of the file
-        read_size = 0;
-    } else if (offset + size > data_size) {
-        // Adjust read_size so as not to read beyond the end of the file
-        read_size = data_size - offset;
+static int wfs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = (struct wfs_handle *)(uintptr_t)fi->fh;
+    return stat_inode(handle->inode_number, handle, stbuf);
+}
+
+static int wfs_truncate(const char *path, off_t size) {
+    unsigned int inode_number = find_inode_number(path);
+    if (inode_number == -1) {
+        return -ENOENT;
+    }
+    return truncate_file(inode_number, NULL, size);
+}
+
+static int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = (struct wfs_handle *)(uintptr_t)fi->fh;
+    return truncate_file(handle->inode_number, handle, size);
+}
+
+// Commit everything written so far, buffered data included. A checkpoint
+// is added if one is due, or if checkpoint is set and anything was written
+// since the last one, after folding directory changes. Version 0
+// superblocks have no room to point at a checkpoint, so those images only
+// get the folding and are always replayed in full. The batch is committed
+// even if a handle could not be flushed, but not synced.
+int close_batch(int checkpoint) {
+    int ret = 0;
+    for (struct wfs_handle *handle = open_handles; handle != NULL; handle = handle->next) {
+        int flush_ret = handle_flush(handle);
+        ret = ret ? ret : flush_ret;
+    }
+    if (log_since_checkpoint != 0 && (checkpoint || log_since_checkpoint >= CHECKPOINT_INTERVAL)) {
+        if (fold_directories() != 0 || (sb.version != 0 && append_checkpoint() != 0)) {
+            fprintf(stderr, "Error writing checkpoint\n");
+        } else if (sb.version == 0) {
+            log_since_checkpoint = 0;
+        }
+    }
+    int commit_ret = commit_log(0);
+    return commit_ret != 0 ? commit_ret : ret;
+}
+
+// close_batch(), then sync if asked and write the superblock so the next
+// mount does not have to roll forward over the batch
+int flush_log(int sync, int checkpoint) {
+    int ret = close_batch(checkpoint);
+    if (sb.head != batch_start) {
+        return ret; // The commit record could not be written
+    }
+    int commit_ret = 0;
+    if (sync && disk_sync() != 0) {
+        perror("Error syncing disk");
+        commit_ret = -EIO;
+    }
+    if (commit_ret == 0) {
+        commit_ret = write_superblock();
+    }
+    if (commit_ret == 0) {
+        commit_ret = submit_writes(0);
+    }
+    return ret ? ret : commit_ret;
+}
+
+// One round of the commit thread. Like flush_log(), except that wfs_lock
+// is only held to close the batch and to write the superblock, not while
+// waiting for the disk in between. The superblock written is the one the
+// batch was closed with, so it never points past what has been synced. In
+// sync mode operations sync their own batches, but one may still be on its
+// way to the disk, so the superblock waits for it too.
+int background_commit(void) {
+    pthread_rwlock_wrlock(&wfs_lock);
+    int ret = close_batch(0);
+    if (sb.head != batch_start) {
+        pthread_rwlock_unlock(&wfs_lock);
+        return ret;
+    }
+    struct wfs_sb committed = sb;
+    struct wfs_sb on_disk = sb_on_disk;
+    uint64_t gen;
+    int commit_ret = disk_sync_begin(&gen);
+    pthread_rwlock_unlock(&wfs_lock);
+
+    if (commit_ret == 0 && config.durability != DURABILITY_NONE) {
+        commit_ret = disk_sync_end(gen);
+    }
+    if (commit_ret == 0) {
+        pthread_rwlock_wrlock(&wfs_lock);
+        // Unless the cleaner has written a newer one meanwhile
+        if (memcmp(&sb_on_disk, &on_disk, sizeof(on_disk)) == 0) {
+            commit_ret = write_superblock_copy(&committed);
+        }
+        if (commit_ret == 0) {
+            commit_ret = submit_writes(0);
+        }
+        pthread_rwlock_unlock(&wfs_lock);
+    }
+    return ret ? ret : commit_ret;
+}
+
+// The cleaner frees the oldest part of a version 2 log one region at a
+// time, so the log wraps around over it instead of filling up. It runs in
+// the background once nothing has happened for CLEAN_IDLE_MS and the log
+// is half full, freeing up to clean_rate bytes a second, and flat out once
+// less than a quarter of the log is free. If even clean_reserve is about
+// to run out, operations clean before they start.
+#define CLEAN_REGION_SIZE (1 << 20)
+#define CLEAN_IDLE_MS 1000
+
+// CLEAN_REGION_SIZE, or less on small disks
+off_t clean_region_size;
+// Bytes cleaned since cleaning last made room, and the value
+// op_bytes_appended had when that reached a whole log. Until operations
+// append again, the log is all live and there is no point in cleaning.
+off_t clean_unproductive;
+off_t clean_gave_up_at = -1;
+long long last_operation_ms;
+
+long long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+int compare_inode_numbers(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Append a copy of the entry at offset. Returns where it went, or a
+// negative errno.
+off_t copy_log_entry(off_t offset) {
+    struct wfs_log_entry *entry = read_log_entry(disk_fd, offset);
+    if (entry == NULL) {
+        return -EIO;
+    }
+    off_t write_offset = append_log_entry(entry, sizeof(struct wfs_inode) + entry->inode.size);
+    free(entry);
+    return write_offset;
+}
+
+#define IN_REGION(offset) ((offset) >= start && (offset) < end)
+
+// Move what a block-mapped file has in [start, end). Blocks are copied as
+// they are, and every indirect block pointing at a moved block is appended
+// again, followed by a new block map if anything moved.
+int relocate_block_mapped(off_t bmap_offset, off_t start, off_t end) {
+    struct wfs_log_entry *bmap_entry = read_log_entry(disk_fd, bmap_offset);
+    if (bmap_entry == NULL) {
+        return -EIO;
+    }
+    struct wfs_bmap *bmap = (struct wfs_bmap *)bmap_entry->data;
+    int moved = IN_REGION(bmap_offset);
+    int ret = 0;
+    for (uint32_t i = 0; i < bmap->num_indirect && ret == 0; i++) {
+        if (bmap->indirect[i] == 0) {
+            continue;
+        }
+        struct wfs_log_entry *indirect_entry = read_log_entry(disk_fd, bmap->indirect[i]);
+        if (indirect_entry == NULL) {
+            ret = -EIO;
+            break;
+        }
+        uint32_t *pointers = (uint32_t *)((struct wfs_block *)indirect_entry->data)->data;
+        int indirect_moved = IN_REGION(bmap->indirect[i]);
+        for (size_t j = 0; j < WFS_PTRS_PER_BLOCK && ret == 0; j++) {
+            if (pointers[j] == 0 || !IN_REGION(pointers[j])) {
+                continue;
+            }
+            off_t write_offset = copy_log_entry(pointers[j]);
+            if (write_offset < 0) {
+                ret = write_offset;
+            } else {
+                pointers[j] = write_offset;
+                indirect_moved = 1;
+            }
+        }
+        if (ret == 0 && indirect_moved) {
+            off_t write_offset = append_log_entry(indirect_entry, sizeof(struct wfs_inode) + indirect_entry->inode.size);
+            if (write_offset < 0) {
+                ret = write_offset;
+            } else {
+                bmap->indirect[i] = write_offset;
+                moved = 1;
+            }
+        }
+        free(indirect_entry);
+    }
+    if (ret == 0 && moved) {
+        off_t write_offset = append_log_entry(bmap_entry, sizeof(struct wfs_inode) + bmap_entry->inode.size);
+        ret = write_offset < 0 ? write_offset : 0;
+    }
+    free(bmap_entry);
+    return ret;
+}
+
+// Append an inline file or a directory again as one full entry if its
+// latest entry, or any delta it is built from, lies in [start, end)
+int relocate_inline(unsigned int inode_number, off_t start, off_t end) {
+    off_t offset = inode_map_get(inode_number);
+    while (!IN_REGION(offset)) {
+        struct wfs_inode inode;
+        if (disk_pread(disk_fd, &inode, sizeof(inode), offset) != sizeof(inode)) {
+            return -EIO;
+        }
+        if (inode.flags != WFS_ENTRY_DELTA && inode.flags != WFS_ENTRY_DIR_DELTA) {
+            return 0;
+        }
+        // Both kinds of delta start with the offset of the entry before
+        uint32_t prev;
+        if (disk_pread(disk_fd, &prev, sizeof(prev), offset + sizeof(inode)) != sizeof(prev)) {
+            return -EIO;
+        }
+        offset = prev;
+    }
+    struct wfs_log_entry *entry = find_last_log_entry(disk_fd, inode_number);
+    if (entry == NULL) {
+        return -EIO;
+    }
+    off_t write_offset = append_log_entry(entry, sizeof(struct wfs_inode) + entry->inode.size);
+    free(entry);
+    return write_offset < 0 ? write_offset : 0;
+}
+
+// Clean the entries that start in the region after the tail. Each inode
+// with an entry there has whatever it still uses from the region appended
+// again, and once the copies are on disk the tail moves past the region.
+// Must be called with no operation half done. Returns the number of bytes
+// freed, or a negative errno.
+off_t clean_region(void) {
+    off_t start = sb.tail;
+    off_t end = start;
+    off_t free_before = log_free_space();
+    unsigned int *inodes = NULL;
+    size_t num_inodes = 0;
+    size_t inodes_cap = 0;
+    int ret = 0;
+
+    // A region never runs past the end of the disk, so it is one range
+    while (end != sb.head && end - start < clean_region_size && end + sizeof(struct wfs_inode) <= disk_size) {
+        struct wfs_inode inode;
+        if (disk_pread(disk_fd, &inode, sizeof(inode), end) != sizeof(inode)) {
+            ret = -EIO;
+            goto out;
+        }
+        if (is_inode_entry(&inode) || inode.flags == WFS_ENTRY_BLOCK || inode.flags == WFS_ENTRY_INDIRECT) {
+            if (num_inodes == inodes_cap) {
+                size_t new_cap = inodes_cap ? inodes_cap * 2 : 256;
+                unsigned int *new_inodes = realloc(inodes, sizeof(unsigned int) * new_cap);
+                if (new_inodes == NULL) {
+                    ret = -ENOMEM;
+                    goto out;
+                }
+                inodes = new_inodes;
+                inodes_cap = new_cap;
+            }
+            inodes[num_inodes++] = inode.inode_number;
+        }
+        end += sizeof(inode) + inode.size;
+    }
+    if (end == start) {
+        goto out; // Nothing to clean
+    }
+
+    qsort(inodes, num_inodes, sizeof(unsigned int), compare_inode_numbers);
+    cleaning = 1;
+    for (size_t i = 0; i < num_inodes && ret == 0; i++) {
+        if (i > 0 && inodes[i] == inodes[i - 1]) {
+            continue;
+        }
+        off_t latest = inode_map_get(inodes[i]);
+        struct wfs_inode inode;
+        if (latest == 0) {
+            continue; // Deleted, so nothing of it is live
+        }
+        if (disk_pread(disk_fd, &inode, sizeof(inode), latest) != sizeof(inode)) {
+            ret = -EIO;
+        } else if (inode.flags == WFS_ENTRY_BMAP) {
+            ret = relocate_block_mapped(latest, start, end);
+        } else {
+            ret = relocate_inline(inodes[i], start, end);
+        }
+    }
+    // Mounts start from the checkpoint, so it must not be freed either
+    if (ret == 0 && sb.checkpoint != 0 && IN_REGION(sb.checkpoint)) {
+        ret = fold_directories();
+        if (ret == 0) {
+            ret = append_checkpoint();
+        }
+    }
+    if (ret == 0) {
+        ret = commit_log(1);
+    }
+    cleaning = 0;
+    if (ret != 0) {
+        goto out;
+    }
+
+    // The region may only be written over once the superblock no longer
+    // sends a mount to it, and once no reply still has to read from it
+    off_t freed_end = end + sizeof(struct wfs_inode) > disk_size ? disk_size : end;
+    wait_for_pinned_reads(start, freed_end);
+    sb.tail = end + sizeof(struct wfs_inode) > disk_size ? WFS_SB_SIZE(&sb) : end;
+    // Once it is, an inode's next entry may land where a handle's cached
+    // one was, so the offset no longer tells whether the cache is current
+    for (struct wfs_handle *handle = open_handles; handle != NULL; handle = handle->next) {
+        handle->entry_offset = 0;
+    }
+    ret = write_superblock();
+    if (ret == 0 && disk_sync() != 0) {
+        perror("Error syncing disk");
+        ret = -EIO;
+    }
+
+    if (log_free_space() > free_before) {
+        clean_unproductive = 0;
+    } else if ((clean_unproductive += end - start) >= disk_size - WFS_SB_SIZE(&sb)) {
+        clean_unproductive = 0;
+        clean_gave_up_at = op_bytes_appended;
+    }
+out:
+    free(inodes);
+    return ret < 0 ? ret : end - start;
+}
+
+#undef IN_REGION
+
+// Whether the cleaner has anything to gain from running
+int clean_worthwhile(void) {
+    return cleaner_enabled && sb.tail != sb.head && clean_gave_up_at != op_bytes_appended;
+}
+
+// Clean before an operation until clean_reserve is free twice over
+void clean_for_space(void) {
+    while (log_free_space() < 2 * clean_reserve && clean_worthwhile()) {
+        if (clean_region() <= 0) {
+            fprintf(stderr, "Log cleaning failed\n");
+            break;
+        }
+    }
+}
+
+// The background threads sleep on their condition variables under
+// thread_lock, which also guards their stop flags, and take wfs_lock
+// exclusively for their work
+pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_t cleaner_thread;
+pthread_cond_t cleaner_cond = PTHREAD_COND_INITIALIZER;
+int cleaner_thread_running;
+int cleaner_thread_stop;
+
+void deadline_after(struct timespec *deadline, unsigned long ms) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+// Background cleaning, one region per hold of wfs_lock
+void *cleaner_thread_main(void *arg) {
+    off_t log_size = disk_size - WFS_SB_SIZE(&sb);
+    pthread_mutex_lock(&thread_lock);
+    while (!cleaner_thread_stop) {
+        pthread_mutex_unlock(&thread_lock);
+        unsigned long wait_ms = CLEAN_IDLE_MS;
+        pthread_rwlock_wrlock(&wfs_lock);
+        off_t free_space = log_free_space();
+        int pressure = free_space < log_size / 4;
+        int idle = monotonic_ms() - __atomic_load_n(&last_operation_ms, __ATOMIC_RELAXED) >= CLEAN_IDLE_MS;
+        if ((pressure || (idle && free_space < log_size / 2)) && clean_worthwhile()) {
+            off_t freed = clean_region();
+            if (freed <= 0) {
+                fprintf(stderr, "Log cleaning failed\n");
+            } else if (pressure) {
+                wait_ms = 0; // Let waiting operations in, then go on
+            } else {
+                wait_ms = freed * 1000 / config.clean_rate;
+            }
+        }
+        pthread_rwlock_unlock(&wfs_lock);
+
+        pthread_mutex_lock(&thread_lock);
+        if (wait_ms != 0 && !cleaner_thread_stop) {
+            struct timespec deadline;
+            deadline_after(&deadline, wait_ms);
+            pthread_cond_timedwait(&cleaner_cond, &thread_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&thread_lock);
+    return NULL;
+}
+
+pthread_t commit_thread;
+pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+int commit_thread_running;
+int commit_thread_stop;
+
+// Background commits for the none and periodic modes. In sync mode every
+// operation is already committed, so this only writes the superblock.
+void *commit_thread_main(void *arg) {
+    pthread_mutex_lock(&thread_lock);
+    while (!commit_thread_stop) {
+        struct timespec deadline;
+        deadline_after(&deadline, config.commit_interval);
+        pthread_cond_timedwait(&commit_cond, &thread_lock, &deadline);
+        if (commit_thread_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&thread_lock);
+        if (background_commit() != 0) {
+            fprintf(stderr, "Background commit failed\n");
+        }
+        pthread_mutex_lock(&thread_lock);
+    }
+    pthread_mutex_unlock(&thread_lock);
+    return NULL;
+}
+
+// Started from init rather than main, since fuse_main() may fork into the
+// background and threads do not survive that
+static void *wfs_init(struct fuse_conn_info *conn) {
+    // Take writes of up to max_write bytes in one request instead of a
+    // page at a time
+    if (conn->capable & FUSE_CAP_BIG_WRITES) {
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    }
+    // Let FUSE splice file data between the kernel and the disk image or
+    // our buffers instead of copying it through its own
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    if (config.use_uring && disk_map == NULL) {
+        uring_init();
+    }
+    if (config.commit_interval != 0 && pthread_create(&commit_thread, NULL, commit_thread_main, NULL) == 0) {
+        commit_thread_running = 1;
+    }
+    __atomic_store_n(&last_operation_ms, monotonic_ms(), __ATOMIC_RELAXED);
+    if (cleaner_enabled && pthread_create(&cleaner_thread, NULL, cleaner_thread_main, NULL) == 0) {
+        cleaner_thread_running = 1;
+    }
+    return NULL;
+}
+
+static void wfs_destroy(void *private_data) {
+    if (cleaner_thread_running) {
+        pthread_mutex_lock(&thread_lock);
+        cleaner_thread_stop = 1;
+        pthread_cond_signal(&cleaner_cond);
+        pthread_mutex_unlock(&thread_lock);
+        pthread_join(cleaner_thread, NULL);
+    }
+    if (commit_thread_running) {
+        pthread_mutex_lock(&thread_lock);
+        commit_thread_stop = 1;
+        pthread_cond_signal(&commit_cond);
+        pthread_mutex_unlock(&thread_lock);
+        pthread_join(commit_thread, NULL);
+    }
+    pthread_rwlock_wrlock(&wfs_lock);
+    if (flush_log(config.durability != DURABILITY_NONE, 1) != 0) {
+        fprintf(stderr, "Final commit failed\n");
     }
+    pthread_rwlock_unlock(&wfs_lock);
+    if (bcache_pages != NULL) {
+        fprintf(stderr, "Block cache: %lu hits, %lu misses, %lu evictions\n", bcache_hits, bcache_misses, bcache_evictions);
+    }
+}
+
+// Each operation below runs under wfs_lock, after cleaning if the log is
+// nearly full, and ends by committing what it appended, as the durability
+// mode asks
+static void begin_operation(void) {
+    pthread_rwlock_wrlock(&wfs_lock);
+    if (log_free_space() < 2 * clean_reserve) {
+        clean_for_space();
+    }
+}
+
+static int end_operation(int ret) {
+    uint64_t gen;
+    int commit_ret = commit_operation(&gen);
+    __atomic_store_n(&last_operation_ms, monotonic_ms(), __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&wfs_lock);
+    if (commit_ret == 0) {
+        commit_ret = disk_sync_end(gen);
+    }
+    return ret < 0 || commit_ret == 0 ? ret : commit_ret;
+}
+
+// Operations that append nothing run side by side
+static void begin_read_operation(void) {
+    pthread_rwlock_rdlock(&wfs_lock);
+}
+
+static int end_read_operation(int ret) {
+    __atomic_store_n(&last_operation_ms, monotonic_ms(), __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&wfs_lock);
+    return ret;
+}
+
+static int locked_getattr(const char *path, struct stat *stbuf) {
+    begin_read_operation();
+    return end_read_operation(wfs_getattr(path, stbuf));
+}
+
+static int locked_mknod(const char *path, mode_t mode, dev_t rdev) {
+    begin_operation();
+    return end_operation(wfs_mknod(path, mode, rdev));
+}
 
-    // Copy data from the log entry into the buffer
-    memcpy(buf, file_entry->data + offset, read_size);
+static int locked_mkdir(const char *path, mode_t mode) {
+    begin_operation();
+    return end_operation(wfs_mkdir(path, mode));
+}
 
-    // Clean up
-    free(file_entry);
+// Opening appends nothing
+static int locked_open(const char *path, struct fuse_file_info *fi) {
+    begin_read_operation();
+    return end_read_operation(wfs_open(path, fi));
+}
 
-    // Return the number of bytes read
-    return read_size;
+static int locked_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    begin_read_operation();
+    return end_read_operation(wfs_read(path, buf, size, offset, fi));
 }
 
+static int locked_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    begin_operation();
+    return end_operation(wfs_write(path, buf, size, offset, fi));
+}
 
-static int wfs_mkdir(const char *path, mode_t mode) {
-    // Check if the file already exists
-    unsigned int inode_number = find_inode_number(path);
-    if (inode_number != -1) {
-        return -EEXIST; // File exists
-    }
+static int locked_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    begin_read_operation();
+    return end_read_operation(wfs_read_buf(path, bufp, size, offset, fi));
+}
 
-    // Extract the parent directory's path and name of the new file
-    char *path_copy_dir = strdup(path); // Make a copy for dirname
-    char *path_copy_base = strdup(path); // Make a copy for basename
-    if (!path_copy_dir || !path_copy_base) {
-        // Handle memory allocation failure
-        free(path_copy_dir);
-        free(path_copy_base);
-        return -ENOMEM;
-    }
-    char *parent_path = dirname(path_copy_dir);
-    char *base_name = basename(path_copy_base);
-    // Find inode number for the parent directory
-    unsigned int parent_inode_number = find_inode_number(parent_path);
-    if (parent_inode_number == -1) {
-        free(path_copy_dir);
-        free(path_copy_base);
-        return -ENOENT; // Parent directory doesn't exist
-    }
+static int locked_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    begin_operation();
+    return end_operation(wfs_write_buf(path, buf, offset, fi));
+}
 
-    // Get the last log entry of the parent directory
-    struct wfs_log_entry *parent_entry = find_last_log_entry(disk_fd, parent_inode_number);
-    if (parent_entry == NULL || !S_ISDIR(parent_entry->inode.mode)) {
-        free(path_copy_dir);
-        free(path_copy_base);
-        return -ENOTDIR; // Parent is not a directory
+// A handle with nothing buffered is flushed or closed with wfs_lock
+// shared. Buffers only fill with it exclusive, so one seen empty stays so.
+static int locked_flush(const char *path, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = (struct wfs_handle *)(uintptr_t)fi->fh;
+    begin_read_operation();
+    if (handle->dirty_len == 0) {
+        return end_read_operation(0);
     }
+    end_read_operation(0);
+    begin_operation();
+    return end_operation(wfs_flush(path, fi));
+}
 
-    // Allocate memory for the new dentry and add it to the parent's data
-    size_t new_data_size = parent_entry->inode.size + sizeof(struct wfs_dentry);
-    char *new_data = malloc(new_data_size);
-    if (new_data == NULL) {
-        free(path_copy_dir);
-        free(path_copy_base);
-        free(parent_entry);
-        return -ENOMEM; // Not enough memory
-    }
-
-    // Manually copy each existing dentry to new data
-    struct wfs_dentry *old_dentries = (struct wfs_dentry *)(parent_entry->data);
-    size_t num_old_dentries = parent_entry->inode.size / sizeof(struct wfs_dentry);
-    for (size_t i = 0; i < num_old_dentries; ++i) {
-        struct wfs_dentry *current_dentry = (struct wfs_dentry *)(new_data + i * sizeof(struct wfs_dentry));
-        *current_dentry = old_dentries[i];
-    }
-
-    // Create and add the new dentry at the end
-    struct wfs_dentry *new_dentry = (struct wfs_dentry *)(new_data + num_old_dentries * sizeof(struct wfs_dentry));
-    
-    unsigned int new_inode_number = -1;
-    // Find the next available inode number
-    for (int i = 1; i < max_inode + 100; i++) {
-        if (used_inodes[i] == 0) {
-            new_inode_number = i;
-            used_inodes[i] = 1;
-            break;
-        }
-    }
-    if (new_inode_number == -1) {
-        free(new_data);
-        free(parent_path);
-        return -ENOSPC;
+static int locked_release(const char *path, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = (struct wfs_handle *)(uintptr_t)fi->fh;
+    begin_read_operation();
+    // Giving back the number of an unlinked file needs wfs_lock exclusive
+    if (handle->dirty_len == 0 && inode_map_get(handle->inode_number) != 0) {
+        unlink_handle(handle);
+        free(handle->dirty);
+        free(handle);
+        return end_read_operation(0);
     }
-    new_dentry->inode_number = new_inode_number;
-    strncpy(new_dentry->name, base_name, MAX_FILE_NAME_LEN - 1);
-    new_dentry->name[MAX_FILE_NAME_LEN - 1] = '\0'; // Ensure null termination
-    // Create the new inode
-    struct wfs_inode new_inode = {
-        .inode_number = new_inode_number,
-        .mode = S_IFDIR | mode, // Regular file with the specified mode
-        .uid = getuid(),
-        .gid = getgid(),
-        .size = 0,
-        .links = 1,
-        .deleted = 0
-    };
-
-    // Create a new log entry for the file
-    struct wfs_log_entry new_file_entry = {
-        .inode = new_inode
-        // .data field is not needed as it's a file with no content yet
-    };
+    end_read_operation(0);
+    begin_operation();
+    return end_operation(wfs_release(path, fi));
+}
 
-    off_t write_offset = sb.head;
-    if (pwrite(disk_fd, &new_file_entry, sizeof(new_file_entry), write_offset) != sizeof(new_file_entry)) {
-        free(new_data);
-        free(parent_entry);
-        free(path_copy_dir);
-        free(path_copy_base);
-        printf("Error in pwrite, child\n");
-        return -EIO; // I/O error
+static int locked_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    begin_operation();
+    int ret = wfs_fsync(path, datasync, fi);
+    uint64_t gen = 0;
+    if (ret == 0) {
+        ret = disk_sync_begin(&gen);
     }
-    sb.head += sizeof(new_file_entry);
-
-    printf("Debug: sb.head = %d\n", sb.head);
-    write_offset = sb.head;
+    ret = end_operation(ret);
+    return ret != 0 ? ret : disk_sync_end(gen);
+}
 
-    // Copy the inode part of the parent entry
-    struct wfs_inode updated_parent_inode = parent_entry->inode;
-    updated_parent_inode.size = (num_old_dentries + 1) * sizeof(struct wfs_dentry);
+static int locked_opendir(const char *path, struct fuse_file_info *fi) {
+    begin_read_operation();
+    return end_read_operation(wfs_opendir(path, fi));
+}
 
-    // Allocate memory for the updated parent entry
-    size_t updated_entry_size = sizeof(struct wfs_inode) + updated_parent_inode.size;
-    struct wfs_log_entry *updated_parent_entry = (struct wfs_log_entry *)malloc(updated_entry_size);
-    if (!updated_parent_entry) {
-        free(new_data);
-        free(parent_entry);
-        free(path_copy_dir);
-        free(path_copy_base);
-        return -ENOMEM;
-    }
+static int locked_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    begin_read_operation();
+    return end_read_operation(wfs_readdir(path, buf, filler, offset, fi));
+}
 
-    // Set up the updated parent entry
-    updated_parent_entry->inode = updated_parent_inode;
-    memcpy(updated_parent_entry->data, new_data, updated_parent_inode.size);
+static int locked_unlink(const char *path) {
+    begin_operation();
+    return end_operation(wfs_unlink(path));
+}
 
-    // Write the updated parent entry to disk
-    write_offset = sb.head; // Current head position
-    if (pwrite(disk_fd, updated_parent_entry, updated_entry_size, write_offset) != updated_entry_size) {
-        free(updated_parent_entry);
-        free(new_data);
-        free(parent_entry);
-        free(path_copy_dir);
-        free(path_copy_base);
-        printf("Error in pwrite, new parent entry\n");
-        return -EIO; // I/O error
-    }
-    sb.head += updated_entry_size; // Update head position
+static int locked_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    begin_operation();
+    return end_operation(wfs_create(path, mode, fi));
+}
 
-    // Clean up
-    free(new_data);
-    free(parent_entry);
-    free(path_copy_dir);
-    free(path_copy_base);
+static int locked_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    begin_read_operation();
+    return end_read_operation(wfs_fgetattr(path, stbuf, fi));
+}
 
-    // Update the superblock with the new head position
-    if (pwrite(disk_fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
-        perror("Error updating superblock");
-        return -EIO; // I/O error
-    }
+static int locked_truncate(const char *path, off_t size) {
+    begin_operation();
+    return end_operation(wfs_truncate(path, size));
+}
 
-    return 0; // Success
+static int locked_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    begin_operation();
+    return end_operation(wfs_ftruncate(path, size, fi));
 }
 
-static int wfs_mknod(const char *path, mode_t mode, dev_t rdev) {
-    // Check if the file already exists
-    unsigned int inode_number = find_inode_number(path);
-    if (inode_number != -1) {
-        return -EEXIST; // File exists
+static struct fuse_operations ops = {
+    .getattr = locked_getattr,
+    .mknod      = locked_mknod,
+    .mkdir      = locked_mkdir,
+    .open       = locked_open,
+    .read	    = locked_read,
+    .write      = locked_write,
+    .read_buf   = locked_read_buf,
+    .write_buf  = locked_write_buf,
+    .flush      = locked_flush,
+    .release    = locked_release,
+    .fsync      = locked_fsync,
+    .opendir    = locked_opendir,
+    .readdir	= locked_readdir,
+    .releasedir = wfs_releasedir,
+    .unlink    	= locked_unlink,
+    .create     = locked_create,
+    .fgetattr   = locked_fgetattr,
+    .truncate   = locked_truncate,
+    .ftruncate  = locked_ftruncate,
+    .init       = wfs_init,
+    .destroy    = wfs_destroy,
+};
+
+// The low-level API below hands operations inode numbers instead of paths.
+// Replies are sent once wfs_lock is released. Every entry replied to the
+// kernel counts as a lookup of its inode until the kernel forgets it, and
+// an unlinked inode's number is not reused while any lookup is left.
+
+// Fill in a reply to a lookup of an inode and count the lookup
+int lookup_inode(unsigned int inode_number, struct fuse_entry_param *entry) {
+    memset(entry, 0, sizeof(*entry));
+    int ret = stat_inode(inode_number, NULL, &entry->attr);
+    if (ret != 0) {
+        return ret;
     }
+    entry->ino = WFS_FUSE_INO(inode_number);
+    entry->attr_timeout = config.attr_timeout;
+    entry->entry_timeout = config.entry_timeout;
+    __atomic_add_fetch(&lookup_counts[inode_number], 1, __ATOMIC_RELAXED);
+    return 0;
+}
 
-    // Extract the parent directory's path and name of the new file
-    char *path_copy_dir = strdup(path); // Make a copy for dirname
-    char *path_copy_base = strdup(path); // Make a copy for basename
-    if (!path_copy_dir || !path_copy_base) {
-        // Handle memory allocation failure
-        free(path_copy_dir);
-        free(path_copy_base);
-        return -ENOMEM;
+// Drop lookups the kernel no longer holds, freeing the number of an
+// unlinked inode once nothing refers to it
+void forget_inode(unsigned int inode_number, uint64_t nlookup) {
+    if (inode_number >= inode_map_len) {
+        return;
     }
-    char *parent_path = dirname(path_copy_dir);
-    char *base_name = basename(path_copy_base);
-    // Find inode number for the parent directory
-    unsigned int parent_inode_number = find_inode_number(parent_path);
-    if (parent_inode_number == -1) {
-        free(path_copy_dir);
-        free(path_copy_base);
-        return -ENOENT; // Parent directory doesn't exist
+    uint64_t count = lookup_counts[inode_number];
+    lookup_counts[inode_number] = nlookup < count ? count - nlookup : 0;
+    if (inode_map_get(inode_number) == 0 && !inode_referenced(inode_number)) {
+        inode_release(inode_number);
     }
+}
 
-    // Get the last log entry of the parent directory
-    struct wfs_log_entry *parent_entry = find_last_log_entry(disk_fd, parent_inode_number);
-    if (parent_entry == NULL || !S_ISDIR(parent_entry->inode.mode)) {
-        free(path_copy_dir);
-        free(path_copy_base);
-        return -ENOTDIR; // Parent is not a directory
+static void reply_entry(fuse_req_t req, const struct fuse_entry_param *entry, int ret) {
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_entry(req, entry);
     }
+}
 
-    // Allocate memory for the new dentry and add it to the parent's data
-    size_t new_data_size = parent_entry->inode.size + sizeof(struct wfs_dentry);
-    char *new_data = malloc(new_data_size);
-    if (new_data == NULL) {
-        free(path_copy_dir);
-        free(path_copy_base);
-        free(parent_entry);
-        return -ENOMEM; // Not enough memory
-    }
-
-    // Manually copy each existing dentry to new data
-    struct wfs_dentry *old_dentries = (struct wfs_dentry *)(parent_entry->data);
-    size_t num_old_dentries = parent_entry->inode.size / sizeof(struct wfs_dentry);
-    for (size_t i = 0; i < num_old_dentries; ++i) {
-        struct wfs_dentry *current_dentry = (struct wfs_dentry *)(new_data + i * sizeof(struct wfs_dentry));
-        *current_dentry = old_dentries[i];
-    }
-
-    // Create and add the new dentry at the end
-    struct wfs_dentry *new_dentry = (struct wfs_dentry *)(new_data + num_old_dentries * sizeof(struct wfs_dentry));
-    
-    unsigned int new_inode_number = -1;
-    // Find the next available inode number
-    for (int i = 1; i < max_inode + 100; i++) {
-        if (used_inodes[i] == 0) {
-            new_inode_number = i;
-            used_inodes[i] = 1;
-            break;
+static void wfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    wfs_init(conn);
+}
+
+static void wfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param entry;
+    int ret = -ENOENT;
+    begin_read_operation();
+    if (strlen(name) >= MAX_FILE_NAME_LEN) {
+        ret = -ENAMETOOLONG;
+    } else {
+        unsigned int inode_number = lookup_dentry(WFS_INODE_NUMBER(parent), name);
+        if (inode_number != -1) {
+            ret = lookup_inode(inode_number, &entry);
         }
     }
-    if (new_inode_number == -1) {
-        free(new_data);
-        free(parent_path);
-        return -ENOSPC;
+    ret = end_read_operation(ret);
+    if (ret == -ENOENT && config.negative_timeout > 0) {
+        // An entry with no inode tells the kernel to cache the miss
+        memset(&entry, 0, sizeof(entry));
+        entry.entry_timeout = config.negative_timeout;
+        ret = 0;
     }
-    new_dentry->inode_number = new_inode_number;
-    strncpy(new_dentry->name, base_name, MAX_FILE_NAME_LEN - 1);
-    new_dentry->name[MAX_FILE_NAME_LEN - 1] = '\0'; // Ensure null termination
-    // Create the new inode
-    struct wfs_inode new_inode = {
-        .inode_number = new_inode_number,
-        .mode = S_IFREG | mode, // Regular file with the specified mode
-        .uid = getuid(),
-        .gid = getgid(),
-        .size = 0,
-        .links = 1,
-        .deleted = 0
-    };
+    reply_entry(req, &entry, ret);
+}
 
-    // Create a new log entry for the file
-    struct wfs_log_entry new_file_entry = {
-        .inode = new_inode
-        // .data field is not needed as it's a file with no content yet
-    };
+static void wfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    pthread_rwlock_wrlock(&wfs_lock);
+    forget_inode(WFS_INODE_NUMBER(ino), nlookup);
+    pthread_rwlock_unlock(&wfs_lock);
+    fuse_reply_none(req);
+}
 
-    off_t write_offset = sb.head;
-    if (pwrite(disk_fd, &new_file_entry, sizeof(new_file_entry), write_offset) != sizeof(new_file_entry)) {
-        free(new_data);
-        free(parent_entry);
-        free(path_copy_dir);
-        free(path_copy_base);
-        printf("Error in pwrite, child\n");
-        return -EIO; // I/O error
+static void wfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    pthread_rwlock_wrlock(&wfs_lock);
+    for (size_t i = 0; i < count; i++) {
+        forget_inode(WFS_INODE_NUMBER(forgets[i].ino), forgets[i].nlookup);
     }
-    sb.head += sizeof(new_file_entry);
-
-    printf("Debug: sb.head = %d\n", sb.head);
-    write_offset = sb.head;
-
-    // Copy the inode part of the parent entry
-    struct wfs_inode updated_parent_inode = parent_entry->inode;
-    updated_parent_inode.size = (num_old_dentries + 1) * sizeof(struct wfs_dentry);
+    pthread_rwlock_unlock(&wfs_lock);
+    fuse_reply_none(req);
+}
 
-    // Allocate memory for the updated parent entry
-    size_t updated_entry_size = sizeof(struct wfs_inode) + updated_parent_inode.size;
-    struct wfs_log_entry *updated_parent_entry = (struct wfs_log_entry *)malloc(updated_entry_size);
-    if (!updated_parent_entry) {
-        free(new_data);
-        free(parent_entry);
-        free(path_copy_dir);
-        free(path_copy_base);
-        return -ENOMEM;
+static void wfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = fi ? (struct wfs_handle *)(uintptr_t)fi->fh : NULL;
+    struct stat stbuf;
+    begin_read_operation();
+    int ret = end_read_operation(stat_inode(WFS_INODE_NUMBER(ino), handle, &stbuf));
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_attr(req, &stbuf, config.attr_timeout);
     }
+}
 
-    // Set up the updated parent entry
-    updated_parent_entry->inode = updated_parent_inode;
-    memcpy(updated_parent_entry->data, new_data, updated_parent_inode.size);
+// Create a node and look it up in one go, as the kernel expects
+static int make_entry(fuse_ino_t parent, const char *name, mode_t mode, struct fuse_entry_param *entry) {
+    unsigned int inode_number;
+    int ret = make_node(WFS_INODE_NUMBER(parent), name, mode, &inode_number);
+    return ret != 0 ? ret : lookup_inode(inode_number, entry);
+}
 
-    // Write the updated parent entry to disk
-    write_offset = sb.head; // Current head position
-    if (pwrite(disk_fd, updated_parent_entry, updated_entry_size, write_offset) != updated_entry_size) {
-        free(updated_parent_entry);
-        free(new_data);
-        free(parent_entry);
-        free(path_copy_dir);
-        free(path_copy_base);
-        printf("Error in pwrite, new parent entry\n");
-        return -EIO; // I/O error
-    }
-    sb.head += updated_entry_size; // Update head position
+static void wfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    struct fuse_entry_param entry;
+    begin_operation();
+    int ret = end_operation(make_entry(parent, name, S_IFREG | mode, &entry));
+    reply_entry(req, &entry, ret);
+}
 
-    // Clean up
-    free(new_data);
-    free(parent_entry);
-    free(path_copy_dir);
-    free(path_copy_base);
+static void wfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct fuse_entry_param entry;
+    begin_operation();
+    int ret = end_operation(make_entry(parent, name, S_IFDIR | mode, &entry));
+    reply_entry(req, &entry, ret);
+}
 
-    // Update the superblock with the new head position
-    if (pwrite(disk_fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
-        perror("Error updating superblock");
-        return -EIO; // I/O error
+static void wfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    struct fuse_entry_param entry;
+    begin_operation();
+    int ret = make_entry(parent, name, S_IFREG | mode, &entry);
+    if (ret == 0) {
+        ret = open_handle(WFS_INODE_NUMBER(entry.ino), fi);
+        if (ret != 0) {
+            // The kernel never hears of the lookup, so it never forgets it
+            forget_inode(WFS_INODE_NUMBER(entry.ino), 1);
+        }
+    }
+    ret = end_operation(ret);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_create(req, &entry, fi);
     }
+}
 
-    return 0; // Success
+static void wfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    begin_operation();
+    fuse_reply_err(req, -end_operation(remove_node(WFS_INODE_NUMBER(parent), name)));
 }
 
-static int wfs_unlink(const char *path) {
-    // Find the inode number for the file
-    unsigned int inode_number = find_inode_number(path);
-    if (inode_number == -1) {
-        // File not found
-        return -ENOENT;
+// Only the size can be set, by truncating. Timestamps that come along
+// with it are ignored, as in the path-based API, which has no utimens.
+static void wfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        return;
     }
-
-    // Get the last log entry of the file
-    struct wfs_log_entry *file_entry = find_last_log_entry(disk_fd, inode_number);
-    if (file_entry == NULL) {
-        return -EIO; // Input/output error
+    struct wfs_handle *handle = fi ? (struct wfs_handle *)(uintptr_t)fi->fh : NULL;
+    struct stat stbuf;
+    begin_operation();
+    int ret = 0;
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        ret = truncate_file(WFS_INODE_NUMBER(ino), handle, attr->st_size);
     }
-
-    // Check if the file is already deleted
-    if (file_entry->inode.deleted) {
-        free(file_entry);
-        return -ENOENT; // No such file or directory
+    if (ret == 0) {
+        ret = stat_inode(WFS_INODE_NUMBER(ino), handle, &stbuf);
+    }
+    ret = end_operation(ret);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_attr(req, &stbuf, config.attr_timeout);
     }
+}
 
-    // Mark the inode as deleted
-    file_entry->inode.deleted = 1;
+static void wfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    begin_read_operation();
+    int ret = end_read_operation(open_handle(WFS_INODE_NUMBER(ino), fi));
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_open(req, fi);
+    }
+}
 
-    // Append the updated log entry to the log
-    off_t write_offset = sb.head;
-    size_t entry_size = sizeof(struct wfs_inode) + file_entry->inode.size;
-    if (pwrite(disk_fd, file_entry, entry_size, write_offset) != entry_size) {
-        free(file_entry);
-        return -EIO; // I/O error
+static void wfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = (struct wfs_handle *)(uintptr_t)fi->fh;
+    struct fuse_bufvec *bufv;
+    struct pinned_read pin;
+    begin_read_operation();
+    int ret = read_file_buf(WFS_INODE_NUMBER(ino), handle, size, offset, 1, &bufv);
+    if (ret == 0) {
+        pin_read(&pin, bufv);
     }
-    sb.head += entry_size;
+    ret = end_read_operation(ret);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        unpin_read(&pin);
+        free_bufvec(bufv);
+    }
+}
 
-    // Update the superblock with the new head position
-    if (pwrite(disk_fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
-        free(file_entry);
-        return -EIO; // I/O error
+static void wfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi) {
+    struct wfs_handle *handle = (struct wfs_handle *)(uintptr_t)fi->fh;
+    begin_operation();
+    int ret = end_operation(buffered_write(WFS_INODE_NUMBER(ino), handle, bufv, offset));
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_write(req, ret);
     }
+}
 
-    free(file_entry);
-    return 0; // Success
+static void wfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].mem = (void *)buf;
+    wfs_ll_write_buf(req, ino, &src, offset, fi);
 }
 
+static void wfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -locked_flush(NULL, fi));
+}
 
-static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    (void) fi; // Unused parameter in this context
+static void wfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -locked_release(NULL, fi));
+}
 
-    // Find the inode number for the file
-    unsigned int inode_number = find_inode_number(path);
-    if (inode_number == -1) {
-        // File not found
-        return -ENOENT;
-    }
+static void wfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -locked_fsync(NULL, datasync, fi));
+}
 
-    // Get the last log entry of the file
-    struct wfs_log_entry *file_entry = find_last_log_entry(disk_fd, inode_number);
-    if (file_entry == NULL) {
-        return -EIO; // Input/output error
+static void wfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct wfs_inode inode;
+    unsigned int depth;
+    begin_read_operation();
+    int ret = end_read_operation(get_inode(WFS_INODE_NUMBER(ino), NULL, &inode, &depth));
+    if (ret != 0) {
+        fuse_reply_err(req, ENOENT);
+    } else if (!S_ISDIR(inode.mode)) {
+        fuse_reply_err(req, ENOTDIR);
+    } else {
+        struct wfs_dir_handle *dir = calloc(1, sizeof(struct wfs_dir_handle));
+        if (dir == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+        fi->fh = (uintptr_t)dir;
+        fuse_reply_open(req, fi);
     }
+}
 
-    // Check if offset + size exceeds the current file size
-    size_t new_size = offset + size > file_entry->inode.size ? offset + size : file_entry->inode.size;
+// Where list_directory() puts the entries of a low-level readdir reply
+struct direntry_buf {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t len;
+};
 
-    // Create a new inode for the updated file
-    struct wfs_inode updated_inode = file_entry->inode;
-    updated_inode.size = new_size;
+static int add_direntry(void *buf, const char *name, const struct stat *stbuf, off_t offset) {
+    struct direntry_buf *entries = buf;
+    size_t entry_size = fuse_add_direntry(entries->req, entries->buf + entries->len, entries->size - entries->len, name, stbuf, offset);
+    if (entry_size > entries->size - entries->len) {
+        return 1;
+    }
+    entries->len += entry_size;
+    return 0;
+}
 
-    // Create a new log entry for the updated file
-    size_t new_entry_size = sizeof(struct wfs_log_entry) + new_size;
-    struct wfs_log_entry *updated_entry = (struct wfs_log_entry *)malloc(new_entry_size);
-    if (!updated_entry) {
-        free(file_entry);
-        return -ENOMEM; // Not enough memory
+static void wfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct direntry_buf entries = { .req = req, .buf = malloc(size), .size = size };
+    if (entries.buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
+    begin_read_operation();
+    struct wfs_dir_handle *dir = fi ? (struct wfs_dir_handle *)(uintptr_t)fi->fh : NULL;
+    int ret = end_read_operation(list_directory(WFS_INODE_NUMBER(ino), dir, offset, &entries, add_direntry));
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_buf(req, entries.buf, entries.len);
+    }
+    free(entries.buf);
+}
 
-    updated_entry->inode = updated_inode;
+static void wfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -wfs_releasedir(NULL, fi));
+}
 
-    // Copy existing data and apply the new data
-    memcpy(updated_entry->data, file_entry->data, file_entry->inode.size);
-    memcpy(updated_entry->data + offset, buf, size);
+static struct fuse_lowlevel_ops ll_ops = {
+    .init           = wfs_ll_init,
+    .destroy        = wfs_destroy,
+    .lookup         = wfs_ll_lookup,
+    .forget         = wfs_ll_forget,
+    .forget_multi   = wfs_ll_forget_multi,
+    .getattr        = wfs_ll_getattr,
+    .setattr        = wfs_ll_setattr,
+    .mknod          = wfs_ll_mknod,
+    .mkdir          = wfs_ll_mkdir,
+    .create         = wfs_ll_create,
+    .unlink         = wfs_ll_unlink,
+    .open           = wfs_ll_open,
+    .read           = wfs_ll_read,
+    .write          = wfs_ll_write,
+    .write_buf      = wfs_ll_write_buf,
+    .flush          = wfs_ll_flush,
+    .release        = wfs_ll_release,
+    .fsync          = wfs_ll_fsync,
+    .opendir        = wfs_ll_opendir,
+    .readdir        = wfs_ll_readdir,
+    .releasedir     = wfs_ll_releasedir,
+};
 
-    // Append the new file log entry to the log
-    off_t write_offset = sb.head;
-    if (pwrite(disk_fd, updated_entry, new_entry_size, write_offset) != new_entry_size) {
-        free(updated_entry);
-        free(file_entry);
-        return -EIO; // I/O error
+// Mount and serve requests through the low-level API, doing by hand what
+// fuse_main() does for the path-based one
+static int fuse_main_lowlevel(struct fuse_args *args) {
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1 || mountpoint == NULL) {
+        return 1;
     }
-    sb.head += new_entry_size;
-
-    // Clean up
-    free(updated_entry);
-    free(file_entry);
-
-    // Update the superblock with the new head position
-    if (pwrite(disk_fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
-        return -EIO; // I/O error
+    struct fuse_chan *chan = fuse_mount(mountpoint, args);
+    if (chan == NULL) {
+        free(mountpoint);
+        return 1;
     }
 
-    // Return the number of bytes written
-    return size;
+    int ret = 1;
+    struct fuse_session *session = fuse_lowlevel_new(args, &ll_ops, sizeof(ll_ops), NULL);
+    if (session != NULL) {
+        if (fuse_set_signal_handlers(session) == 0) {
+            fuse_session_add_chan(session, chan);
+            if (fuse_daemonize(foreground) == 0) {
+                ret = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+                ret = ret == 0 ? 0 : 1;
+            }
+            fuse_remove_signal_handlers(session);
+            fuse_session_remove_chan(chan);
+        }
+        fuse_session_destroy(session);
+    }
+    fuse_unmount(mountpoint, chan);
+    free(mountpoint);
+    return ret;
 }
 
-static struct fuse_operations ops = {
-    .getattr = wfs_getattr,
-    .mknod      = wfs_mknod,
-    .mkdir      = wfs_mkdir,
-    .read	    = wfs_read,
-    .write      = wfs_write,
-    .readdir	= wfs_readdir,
-    .unlink    	= wfs_unlink,
-};
-
 int main(int argc, char *argv[])
 {
     // Initialize FUSE with specified operations
@@ -708,6 +4518,12 @@ int main(int argc, char *argv[])
         printf("Usage: %s <mountpoint> <disk image>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&wfs_lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+
     char *disk_path = argv[argc - 2];
     disk_fd = open(disk_path, O_RDWR);
     if (disk_fd == -1)
@@ -716,7 +4532,7 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (pread(disk_fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+    if (disk_pread(disk_fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
         perror("Error reading superblock");
         close(disk_fd);
         return -1;
@@ -726,42 +4542,102 @@ int main(int argc, char *argv[])
         close(disk_fd);
         return -1;
     }
-    //Initialize the used_inodes array
-    // Step 1: Find the maximum inode number
-    off_t current_offset = sizeof(struct wfs_sb);
-    struct wfs_log_entry *entry;
-    max_inode = 0;
-    // This approach may be wrong, could be better to use an array of available inode numbers
-    while (current_offset < sb.head && ((entry = read_log_entry(disk_fd, current_offset)) != NULL)) {
-        if (entry->inode.inode_number > max_inode) {
-            max_inode = entry->inode.inode_number;
-        }
-        current_offset += sizeof(struct wfs_inode) + entry->inode.size;
-        free(entry);
+    if (sb.version > WFS_VERSION) {
+        fprintf(stderr, "Unsupported filesystem version %u\n", sb.version);
+        close(disk_fd);
+        return -1;
+    }
+    if (sb.version < 2) {
+        // What was read past the end of an older superblock is the root entry
+        sb.tail = WFS_SB_SIZE(&sb);
+        sb.seq = 0;
+    }
+    struct stat disk_stat;
+    if (fstat(disk_fd, &disk_stat) != 0) {
+        perror("Error reading disk size");
+        close(disk_fd);
+        return -1;
+    }
+    disk_size = disk_stat.st_size;
+    if (recover_log() != 0) {
+        close(disk_fd);
+        return -1;
     }
-    //Create array of sie max_inode + 1
-    //Initialize all values to 0
 
-    used_inodes = malloc(sizeof(unsigned int) * (max_inode + 100));
-    for (int i = 0; i < max_inode + 1; i++) {
-        used_inodes[i] = 0;
+    // Start from the latest checkpoint and replay the log after it
+    off_t replay_start = load_checkpoint();
+    if (replay_start < 0 || replay_log(replay_start) != 0) {
+        close(disk_fd);
+        return -1;
     }
 
-    //For every non deleted node set the value to 1
-    current_offset = sizeof(struct wfs_sb);
-    while (current_offset < sb.head && ((entry = read_log_entry(disk_fd, current_offset)) != NULL)) {
-        if (!entry->inode.deleted) {
-            used_inodes[entry->inode.inode_number] = 1;
+    // Every inode with a live entry has its number in use
+    for (unsigned int i = 0; i < inode_map_len; i++) {
+        if (inode_map[i] != 0 && inode_mark_used(i) != 0) {
+            close(disk_fd);
+            return -1;
         }
-        current_offset += sizeof(struct wfs_inode) + entry->inode.size;
-        free(entry);
     }
+
       // Remove the disk image path from the argument list passed to fuse_main
     // Note: we need to shift the mount point to where the disk image path was.
     argv[argc - 2] = argv[argc - 1];
     argc--;
 
-    return fuse_main(argc, argv, &ops, NULL);
+    // Pick out our own -o options and leave the rest for FUSE
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &config, wfs_opts, NULL) == -1) {
+        close(disk_fd);
+        return -1;
+    }
+    // The path-based API replies to lookups inside libfuse, so there the
+    // timeouts are passed on as its options
+    char timeouts[128];
+    snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g",
+             config.entry_timeout, config.attr_timeout, config.negative_timeout);
+    if (fuse_opt_insert_arg(&args, 1, DEFAULT_FUSE_OPTS) == -1 ||
+        (!config.lowlevel && fuse_opt_add_arg(&args, timeouts) == -1)) {
+        close(disk_fd);
+        return -1;
+    }
+    if (dcache_init(config.dcache_size) != 0) {
+        close(disk_fd);
+        return -1;
+    }
+    if (!config.use_mmap && bcache_init(config.block_cache_size) != 0) {
+        close(disk_fd);
+        return -1;
+    }
+    if (config.use_mmap) {
+        // What recovery queued must reach the disk first, or it would go
+        // out later on top of newer writes through the mapping
+        if (submit_writes(0) != 0) {
+            perror("Error writing recovered superblock");
+            close(disk_fd);
+            return -1;
+        }
+        disk_map = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+        if (disk_map == MAP_FAILED) {
+            perror("Error mapping disk");
+            close(disk_fd);
+            return -1;
+        }
+    }
+    if (sb.version >= 2 && config.clean_rate != 0) {
+        off_t log_size = disk_size - WFS_SB_SIZE(&sb);
+        clean_region_size = log_size / 32 < CLEAN_REGION_SIZE ? log_size / 32 : CLEAN_REGION_SIZE;
+        clean_reserve = 4 * clean_region_size;
+        cleaner_enabled = 1;
+    }
+
+    int ret;
+    if (config.lowlevel) {
+        ret = fuse_main_lowlevel(&args);
+    } else {
+        ret = fuse_main(args.argc, args.argv, &ops, NULL);
+    }
+    fuse_opt_free_args(&args);
+    return ret;
 }
 
 /*
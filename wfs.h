@@ -6,12 +6,24 @@
 
 #define MAX_FILE_NAME_LEN 32
 #define WFS_MAGIC 0xdeadbeef
+#define WFS_VERSION 2
 
 struct wfs_sb {
     uint32_t magic;
     uint32_t head;
+    uint32_t version;       // WFS_VERSION, or 0 for images made before this field
+    uint32_t checkpoint;    // offset of the latest checkpoint entry, 0 if there is none
+    uint32_t tail;          // offset of the oldest entry still in use
+    uint32_t seq;           // sequence number of the last commit record before head
 };
 
+// Version 0 superblocks stop after head, and the log starts right there.
+// The first entry is always the root's, so version reads as 0 on them.
+// Version 1 superblocks stop after checkpoint. Logs older than version 2
+// never wrap, and their tail is the start of the log.
+#define WFS_SB_SIZE(sb) ((sb)->version == 0 ? offsetof(struct wfs_sb, version) : \
+                         (sb)->version == 1 ? offsetof(struct wfs_sb, tail) : sizeof(struct wfs_sb))
+
 struct wfs_inode {
     unsigned int inode_number;
     unsigned int deleted;       // 1 if deleted, 0 otherwise
@@ -36,4 +48,73 @@ struct wfs_log_entry {
     char data[];
 };
 
+// Kinds of log entries, stored in wfs_inode.flags. Whatever the kind, an
+// entry is always followed by exactly inode.size bytes of data.
+#define WFS_ENTRY_FULL  0   // data is the whole file or directory
+#define WFS_ENTRY_DELTA 1   // data is a wfs_delta followed by the written bytes
+#define WFS_ENTRY_BMAP  2   // data is a wfs_bmap locating the file's blocks
+#define WFS_ENTRY_BLOCK 3   // data is a wfs_block holding WFS_BLOCK_SIZE bytes of a file
+#define WFS_ENTRY_INDIRECT 4 // data is a wfs_block holding WFS_PTRS_PER_BLOCK block offsets
+#define WFS_ENTRY_COMMIT 5  // data is a wfs_commit closing the batch of entries before it
+#define WFS_ENTRY_CHECKPOINT 6 // data is a wfs_checkpoint
+#define WFS_ENTRY_DIR_DELTA 7 // data is a wfs_dir_delta
+#define WFS_ENTRY_WRAP 8    // fills the rest of the disk, the log goes on at its start
+
+// A write to part of a file. The current contents are the last full entry
+// for the inode with every delta after it applied in log order.
+struct wfs_delta {
+    uint32_t prev;          // offset of the previous entry for this inode
+    uint32_t depth;         // number of deltas since the last full entry, including this one
+    uint32_t offset;        // file offset the bytes were written at
+    uint32_t length;        // number of bytes that follow
+    uint32_t file_size;     // size of the file after this write
+};
+
+// A dentry added to or removed from a directory. The directory is its last
+// full entry with every change after it applied in log order. Chains are
+// folded back into a full entry when a checkpoint is written.
+struct wfs_dir_delta {
+    uint32_t prev;          // offset of the previous entry for this directory
+    uint32_t depth;         // number of changes since the last full entry, including this one
+    uint32_t removed;       // 1 if dentry was removed, 0 if it was added
+    uint32_t dir_size;      // size of the directory's dentries after this change
+    struct wfs_dentry dentry;
+};
+
+// Large files are not stored inline. Their contents live in fixed-size
+// block entries, found through indirect blocks listed by a block map
+// entry, so one write only appends the blocks it touches plus a new map.
+// A block offset of 0 is a hole and reads as zeros.
+#define WFS_BLOCK_SIZE 4096
+#define WFS_PTRS_PER_BLOCK (WFS_BLOCK_SIZE / sizeof(uint32_t))
+
+struct wfs_bmap {
+    uint32_t file_size;     // size of the file in bytes
+    uint32_t num_indirect;  // number of entries in indirect
+    uint32_t indirect[];    // offsets of the indirect blocks, WFS_PTRS_PER_BLOCK file blocks each
+};
+
+struct wfs_block {
+    uint32_t index;         // block number within the file, or within the indirect list
+    char data[];            // WFS_BLOCK_SIZE bytes
+};
+
+// Entries are appended in batches, each closed by a commit record. The
+// superblock head is only written now and then, so after a crash the mount
+// rolls it forward over every batch whose commit record checks out. Once
+// the log wraps, the sequence number tells a new batch from one left over
+// from the previous pass. Records written before version 2 end at crc.
+struct wfs_commit {
+    uint32_t start;         // offset of the first entry of the batch
+    uint32_t crc;           // CRC-32 of every byte from start up to this record
+    uint32_t seq;           // one more than the previous commit record's
+};
+
+// A snapshot of the inode map covering every entry before it. The mount
+// loads the one the superblock points at and replays only what follows.
+struct wfs_checkpoint {
+    uint32_t num_inodes;    // one more than the highest inode number any entry has used
+    uint32_t inode_map[];   // offset of each inode's latest entry, 0 if free
+};
+
 #endif